@@ -1,16 +1,19 @@
 #include "ChatWindow.hpp"
 #include "ui_ChatWindow.h"
 
+#include <unordered_set>
+
 #include <QIcon>
 #include <QCloseEvent>
 
 #include "matrix/Room.hpp"
+#include "matrix/Session.hpp"
 
 #include "RoomView.hpp"
 #include "RoomViewList.hpp"
 
-ChatWindow::ChatWindow(ThumbnailCache &cache, QWidget *parent)
-  : QWidget(parent), ui(new Ui::ChatWindow), room_list_(new RoomViewList(this)), cache_{cache} {
+ChatWindow::ChatWindow(ThumbnailCache &cache, MemoryBudget &budget, QWidget *parent)
+  : QWidget(parent), ui(new Ui::ChatWindow), room_list_(new RoomViewList(this)), cache_{cache}, budget_{budget} {
   ui->setupUi(this);
 
   setAttribute(Qt::WA_DeleteOnClose);
@@ -76,7 +79,7 @@ void ChatWindow::add(matrix::Room &r, RoomView *v) {
 void ChatWindow::add_or_focus(matrix::Room &room) {
   RoomView *view;
   if(rooms_.find(room.id()) == rooms_.end()) {
-    view = new RoomView(cache_, room, this);
+    view = new RoomView(cache_, budget_, room, this);
     add(room, view);
   } else {
     room_list_->activate(room.id());
@@ -119,9 +122,14 @@ void ChatWindow::changeEvent(QEvent *e) {
 }
 
 void ChatWindow::closeEvent(QCloseEvent *evt) {
+  std::unordered_set<matrix::Session *> sessions;
   for(auto &r : rooms_) {
+    sessions.insert(&r.second->room().session());
     released(r.first);
   }
+  for(auto session : sessions) {
+    session->flush_read_receipts();
+  }
   evt->accept();
 }
 
@@ -11,6 +11,7 @@
 class RoomView;
 class RoomViewList;
 class ThumbnailCache;
+class MemoryBudget;
 
 namespace matrix {
 class Room;
@@ -25,7 +26,7 @@ class ChatWindow : public QWidget
   Q_OBJECT
 
 public:
-  explicit ChatWindow(ThumbnailCache &cache, QWidget *parent = 0);
+  ChatWindow(ThumbnailCache &cache, MemoryBudget &budget, QWidget *parent = 0);
   ~ChatWindow();
 
   void add(matrix::Room &r, RoomView *); // Takes ownership
@@ -51,6 +52,7 @@ private:
   RoomViewList *room_list_;
   std::unordered_map<matrix::RoomID, RoomView *> rooms_;
   ThumbnailCache &cache_;
+  MemoryBudget &budget_;
 
   void update_title();
   void current_changed(int i);
@@ -0,0 +1,97 @@
+#ifndef NACHAT_FENWICK_TREE_HPP_
+#define NACHAT_FENWICK_TREE_HPP_
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+// Binary indexed tree over a sequence of non-negative values, giving O(log n) point updates, prefix sums, and search by
+// prefix sum.
+template<typename T>
+class FenwickTree {
+public:
+  void assign(std::vector<T> values);
+  // Replace contents in O(n)
+
+  void clear() noexcept { values_.clear(); tree_.clear(); }
+
+  void push_back(T value);
+  // Append in O(log n)
+
+  std::size_t size() const noexcept { return values_.size(); }
+  const T &operator[](std::size_t i) const noexcept { return values_[i]; }
+
+  void set(std::size_t i, T value);
+
+  T prefix(std::size_t n) const;
+  // Sum of the first n values
+
+  T total() const { return prefix(size()); }
+
+  std::size_t find(T x) const;
+  // Largest n such that prefix(n) <= x, i.e. the index of the value whose span contains x, or size() if x is beyond
+  // the total
+
+private:
+  std::vector<T> values_;
+  std::vector<T> tree_;         // 1-based; tree_[i] is the sum of the (i & -i) values ending at i
+};
+
+template<typename T>
+void FenwickTree<T>::assign(std::vector<T> values) {
+  values_ = std::move(values);
+  tree_.assign(values_.size() + 1, T{});
+  for(std::size_t i = 1; i <= values_.size(); ++i) {
+    tree_[i] += values_[i-1];
+    const std::size_t parent = i + (i & -i);
+    if(parent <= values_.size()) tree_[parent] += tree_[i];
+  }
+}
+
+template<typename T>
+void FenwickTree<T>::push_back(T value) {
+  if(tree_.empty()) tree_.push_back(T{});
+  values_.push_back(value);
+  // The new node covers the (i & -i) values ending at i; all but the last are covered by the nodes chained below i
+  const std::size_t i = values_.size();
+  T sum = std::move(value);
+  for(std::size_t j = i - 1; j > i - (i & -i); j -= j & -j) {
+    sum += tree_[j];
+  }
+  tree_.push_back(std::move(sum));
+}
+
+template<typename T>
+void FenwickTree<T>::set(std::size_t i, T value) {
+  const T delta = value - values_[i];
+  values_[i] = std::move(value);
+  for(std::size_t j = i + 1; j <= values_.size(); j += j & -j) {
+    tree_[j] += delta;
+  }
+}
+
+template<typename T>
+T FenwickTree<T>::prefix(std::size_t n) const {
+  T result{};
+  for(; n > 0; n -= n & -n) {
+    result += tree_[n];
+  }
+  return result;
+}
+
+template<typename T>
+std::size_t FenwickTree<T>::find(T x) const {
+  std::size_t step = 1;
+  while(step * 2 <= values_.size()) step *= 2;
+
+  std::size_t pos = 0;
+  for(; step > 0; step /= 2) {
+    if(pos + step <= values_.size() && tree_[pos + step] <= x) {
+      pos += step;
+      x -= tree_[pos];
+    }
+  }
+  return pos;
+}
+
+#endif
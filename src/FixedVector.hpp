@@ -32,12 +32,15 @@ public:
     }
   }
 
-  FixedVector(FixedVector &&other) noexcept : size_{other.size}, capacity_{other.capacity}, data_{std::move(other.data_)} {
+  FixedVector(FixedVector &&other) noexcept : size_{other.size_}, capacity_{other.capacity_}, data_{std::move(other.data_)} {
     other.size_ = 0;
     other.capacity_ = 0;
   }
 
-  FixedVector &operator=(FixedVector &&other) {
+  FixedVector &operator=(FixedVector &&other) noexcept(std::is_nothrow_destructible<T>::value) {
+    for(auto &x : *this) {
+      x.~T();
+    }
     size_ = other.size_;
     capacity_ = other.capacity_;
     data_ = std::move(other.data_);
@@ -0,0 +1,61 @@
+#include "LineCache.hpp"
+
+#include <tuple>
+#include <functional>
+
+#include <QHash>
+
+bool LineCache::Key::operator==(const Key &other) const {
+  return std::tie(event, echo, paragraph, text_hash, font, width, first_line)
+    == std::tie(other.event, other.echo, other.paragraph, other.text_hash, other.font, other.width, other.first_line);
+}
+
+std::size_t LineCache::KeyHash::operator()(const Key &key) const {
+  std::size_t result = qHash(key.event);
+  auto combine = [&](std::size_t h) { result ^= h + 0x9e3779b9 + (result << 6) + (result >> 2); };
+  combine(std::hash<uint64_t>()(key.echo));
+  combine(key.paragraph);
+  combine(key.text_hash);
+  combine(qHash(key.font));
+  combine(std::hash<qreal>()(key.width));
+  combine(key.first_line);
+  return result;
+}
+
+std::size_t LineCache::cost(const Entry &entry) {
+  return sizeof(Entry) + (entry.key.event.size() + entry.key.font.size()) * sizeof(QChar)
+    + entry.lines.capacity() * sizeof(int);
+}
+
+const std::vector<int> *LineCache::find(const Key &key) {
+  auto it = index_.find(key);
+  if(it == index_.end()) return nullptr;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->lines;
+}
+
+void LineCache::insert(Key key, std::vector<int> lines) {
+  auto existing = index_.find(key);
+  if(existing != index_.end()) {
+    size_ -= cost(*existing->second);
+    entries_.erase(existing->second);
+    index_.erase(existing);
+  }
+
+  entries_.push_front(Entry{std::move(key), std::move(lines)});
+  index_.emplace(entries_.front().key, entries_.begin());
+  size_ += cost(entries_.front());
+
+  while(size_ > budget_ && entries_.size() > 1) {
+    const auto &victim = entries_.back();
+    size_ -= cost(victim);
+    index_.erase(victim.key);
+    entries_.pop_back();
+  }
+}
+
+void LineCache::clear() {
+  index_.clear();
+  entries_.clear();
+  size_ = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef NACHAT_LINE_CACHE_HPP_
+#define NACHAT_LINE_CACHE_HPP_
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include <QString>
+
+// Remembers where recently laid out paragraphs broke into lines, so that returning to a width doesn't repeat the search
+// for break opportunities. Least recently used entries are evicted to stay within a memory budget.
+class LineCache {
+public:
+  struct Key {
+    QString event;              // Matrix event ID, which survives the event being discarded and loaded again
+    uint64_t echo;              // Identifies a local echo, which has no event ID yet; otherwise 0
+    std::size_t paragraph;
+    uint text_hash;             // Stands in for a content revision, since redaction rewrites text in place
+    QString font;               // QFont::key()
+    qreal width;
+    std::size_t first_line;     // Index of the paragraph's first line within its block, saturating at the last indented line
+
+    bool operator==(const Key &other) const;
+  };
+
+  explicit LineCache(std::size_t budget) : budget_{budget}, size_{0} {}
+
+  const std::vector<int> *find(const Key &key);
+  // Text length of each line, or null if not cached. Marks the entry as recently used.
+
+  void insert(Key key, std::vector<int> lines);
+  void clear();
+
+  std::size_t size() const { return size_; } // Approximate bytes used
+
+private:
+  struct KeyHash {
+    std::size_t operator()(const Key &key) const;
+  };
+
+  struct Entry {
+    Key key;
+    std::vector<int> lines;
+  };
+
+  using List = std::list<Entry>;
+
+  const std::size_t budget_;
+  std::size_t size_;
+  List entries_;                // Most recently used first
+  std::unordered_map<Key, List::iterator, KeyHash> index_;
+
+  static std::size_t cost(const Entry &entry);
+};
+
+#endif
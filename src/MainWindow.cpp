@@ -172,7 +172,7 @@ void RoomWindowBridge::check_release(const matrix::RoomID &room) {
 
 ChatWindow *MainWindow::spawn_chat_window() {
   // We don't create these as children to prevent Qt from hinting to WMs that they should be floating
-  auto window = new ChatWindow(thumbnail_cache_);
+  auto window = new ChatWindow(thumbnail_cache_, timeline_budget_);
   connect(window, &ChatWindow::focused, [this, window]() {
       last_focused_ = window;
     });
@@ -10,6 +10,7 @@
 #include "matrix/ID.hpp"
 
 #include "ContentCache.hpp"
+#include "MemoryBudget.hpp"
 #include "JoinedRoomListModel.hpp"
 
 class QProgressBar;
@@ -44,6 +45,7 @@ private:
   QLabel *sync_label_;
   QPointer<ChatWindow> last_focused_;
   ThumbnailCache thumbnail_cache_;
+  MemoryBudget timeline_budget_; // Shared by every room's timeline
   JoinedRoomListModel rooms_;
   std::unordered_map<matrix::RoomID, ChatWindow *> windows_;
 
@@ -0,0 +1,22 @@
+#include "MemoryBudget.hpp"
+
+std::size_t MemoryBudget::usage(const void *consumer) const {
+  auto it = usage_.find(consumer);
+  return it == usage_.end() ? 0 : it->second;
+}
+
+void MemoryBudget::set_usage(const void *consumer, std::size_t bytes) {
+  const bool was_over = total_ > total_limit_;
+  auto &entry = usage_[consumer];
+  total_ = total_ - entry + bytes;
+  entry = bytes;
+  // Only on crossing the limit, since consumers respond by shrinking and reporting again
+  if(!was_over && total_ > total_limit_) exceeded();
+}
+
+void MemoryBudget::release(const void *consumer) {
+  auto it = usage_.find(consumer);
+  if(it == usage_.end()) return;
+  total_ -= it->second;
+  usage_.erase(it);
+}
@@ -0,0 +1,39 @@
+#ifndef NACHAT_MEMORY_BUDGET_HPP_
+#define NACHAT_MEMORY_BUDGET_HPP_
+
+#include <unordered_map>
+#include <cstddef>
+
+#include <QObject>
+
+// Approximate memory held by each of a set of consumers, e.g. timeline views, so that each can stay within a limit of
+// its own and together they stay within a global one.
+class MemoryBudget : public QObject {
+  Q_OBJECT
+
+public:
+  explicit MemoryBudget(std::size_t total_limit = 256 * 1024 * 1024, std::size_t consumer_limit = 64 * 1024 * 1024,
+                        QObject *parent = nullptr)
+    : QObject{parent}, total_limit_{total_limit}, consumer_limit_{consumer_limit}, total_{0} {}
+
+  std::size_t total_limit() const { return total_limit_; }
+  std::size_t consumer_limit() const { return consumer_limit_; }
+
+  std::size_t total() const { return total_; }
+  std::size_t usage(const void *consumer) const;
+
+  void set_usage(const void *consumer, std::size_t bytes);
+  // Record what consumer currently holds
+  void release(const void *consumer);
+
+signals:
+  void exceeded();
+  // The total went over its limit; consumers should discard what they can spare
+
+private:
+  const std::size_t total_limit_, consumer_limit_;
+  std::size_t total_;
+  std::unordered_map<const void *, std::size_t> usage_;
+};
+
+#endif
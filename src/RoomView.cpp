@@ -7,6 +7,7 @@
 #include <QGuiApplication>
 #include <QCursor>
 #include <QScrollBar>
+#include <QTimer>
 #include <QDebug>
 
 #include "matrix/Room.hpp"
@@ -21,9 +22,9 @@
 
 using std::experimental::optional;
 
-RoomView::RoomView(ThumbnailCache &cache, matrix::Room &room, QWidget *parent)
+RoomView::RoomView(ThumbnailCache &cache, MemoryBudget &budget, matrix::Room &room, QWidget *parent)
   : QWidget(parent), ui(new Ui::RoomView),
-    timeline_view_(new TimelineView(room.session().homeserver(), cache, this)),
+    timeline_view_(new TimelineView(room.session().homeserver(), cache, budget, this)),
     room_(room),
     timeline_manager_{new matrix::TimelineManager(room, this)},
     member_list_(new matrix::MemberListModel(room, initial_icon_size(*this), devicePixelRatioF(), this)),
@@ -31,34 +32,47 @@ RoomView::RoomView(ThumbnailCache &cache, matrix::Room &room, QWidget *parent)
   ui->setupUi(this);
 
   connect(timeline_manager_, &matrix::TimelineManager::grew,
-          [this](matrix::Direction dir, const matrix::TimelineCursor &begin, const matrix::RoomState &state, const matrix::event::Room &evt) {
+          [this](matrix::Direction dir, const matrix::TimelineCursor &begin, const matrix::RoomState &state, gsl::span<const matrix::event::Room> events) {
             if(dir == matrix::Direction::BACKWARD) {
-              timeline_view_->prepend(begin, state, evt);
+              timeline_view_->prepend(begin, state, events);
             } else {
-              timeline_view_->append(begin, state, evt);
+              timeline_view_->append(begin, state, events);
               timeline_view_->set_at_bottom(timeline_manager_->window().at_end());
             }
           });
+  connect(timeline_manager_, &matrix::TimelineManager::filled, timeline_view_, &TimelineView::insert);
+  connect(timeline_manager_, &matrix::TimelineManager::gap_changed, timeline_view_, &TimelineView::set_gap);
+  connect(timeline_manager_, &matrix::TimelineManager::cleared, timeline_view_, &TimelineView::clear);
+  connect(timeline_manager_, &matrix::TimelineManager::anchored, timeline_view_, &TimelineView::scroll_to);
+  connect(timeline_manager_, &matrix::TimelineManager::jump_failed, [this](const matrix::EventID &event, const QString &msg) {
+      qCritical() << tr("Failed to find event %1: %2").arg(event.value()).arg(msg);
+    });
   connect(timeline_manager_, &matrix::TimelineManager::discontinuity, [this]() {
       timeline_view_->set_at_bottom(false); // FIXME: Reset view history
     });
   connect(timeline_view_, &TimelineView::discarded_before, [this](const matrix::TimelineCursor &c) {
-      timeline_manager_->window().discard(c, matrix::Direction::BACKWARD);
+      timeline_manager_->discard(c, matrix::Direction::BACKWARD);
     });
   connect(timeline_view_, &TimelineView::discarded_after, [this](const matrix::TimelineCursor &c) {
-      timeline_manager_->window().discard(c, matrix::Direction::FORWARD);
+      timeline_manager_->discard(c, matrix::Direction::FORWARD);
     });
 
-  connect(timeline_view_, &TimelineView::need_backwards, [this]() { timeline_manager_->grow(matrix::Direction::BACKWARD); });
-  connect(timeline_view_, &TimelineView::need_forwards, [this]() { timeline_manager_->grow(matrix::Direction::FORWARD); });
+  connect(timeline_view_, &TimelineView::need_backwards, [this](std::size_t events) { timeline_manager_->grow(matrix::Direction::BACKWARD, events); });
+  connect(timeline_view_, &TimelineView::need_forwards, [this](std::size_t events) { timeline_manager_->grow(matrix::Direction::FORWARD, events); });
+  connect(timeline_view_, &TimelineView::prefetch_cancelled, timeline_manager_, &matrix::TimelineManager::cancel);
   connect(timeline_view_, &TimelineView::redact_requested, &room, &matrix::Room::redact); // TODO: Add to timeline_view_'s pending events
-  connect(timeline_view_, &TimelineView::event_read, &room, &matrix::Room::send_read_receipt);
+  connect(timeline_view_, &TimelineView::event_read, [&room](const matrix::EventID &id) {
+      room.session().schedule_read_receipt(room, id);
+    });
   connect(&room, &matrix::Room::receipts_changed, this, &RoomView::update_last_read);
+  connect(&room, &matrix::Room::receipts_changed, this, &RoomView::update_read_markers);
+  connect(&room, &matrix::Room::sync_complete, this, &RoomView::update_read_markers); // Evicted events lose their markers
 
   // Ensure redactions apply instantly even when the view is scrolled back and therefore not receiving sync events.
   connect(&room, &matrix::Room::redaction, timeline_view_, &TimelineView::redact);
 
   timeline_manager_->replay();
+  update_read_markers();
   timeline_view_->set_at_bottom(timeline_manager_->window().at_end());
 
   auto menu = new RoomMenu(room, this);
@@ -71,6 +85,27 @@ RoomView::RoomView(ThumbnailCache &cache, matrix::Room &room, QWidget *parent)
   ui->central_splitter->setSizes({-1, fontMetrics().width('x')*24});
 
   ui->member_list->setModel(member_list_);
+  {
+    // Avatars are only fetched for rows that are displayed. Checked once the list has settled after any change.
+    auto avatar_timer = new QTimer(this);
+    avatar_timer->setSingleShot(true);
+    avatar_timer->setInterval(0);
+    connect(avatar_timer, &QTimer::timeout, [this]() {
+        auto view = ui->member_list;
+        const auto first = view->indexAt(view->viewport()->rect().topLeft());
+        if(!first.isValid()) return;
+        const auto last = view->indexAt(view->viewport()->rect().bottomLeft());
+        member_list_->fetch_avatars(first.row(), last.isValid() ? last.row() : member_list_->rowCount(QModelIndex()) - 1);
+      });
+    auto schedule = [avatar_timer]() { avatar_timer->start(); };
+    connect(ui->member_list->verticalScrollBar(), &QScrollBar::valueChanged, schedule);
+    connect(ui->member_list->verticalScrollBar(), &QScrollBar::rangeChanged, schedule);
+    connect(member_list_, &QAbstractItemModel::modelReset, schedule);
+    connect(member_list_, &QAbstractItemModel::rowsInserted, schedule);
+    connect(member_list_, &QAbstractItemModel::rowsMoved, schedule);
+    connect(member_list_, &QAbstractItemModel::dataChanged, schedule);  // Includes avatar URL changes
+    avatar_timer->start();
+  }
 
   layout()->addWidget(entry_);
   setFocusProxy(entry_);
@@ -116,6 +151,12 @@ void RoomView::command(const QString &name, const QString &args) {
          matrix::event::Content{{
              {{"msgtype", "m.emote"},
                {"body", args}}}});
+  } else if(name == "jump") {
+    if(!args.isEmpty()) {
+      jump_to(matrix::EventID{args.trimmed()});
+    } else if(auto r = room_.receipt_from(room_.session().user_id())) {
+      jump_to(r->event);
+    }
   } else if(name == "join") {
     auto req = room_.session().join(args);
     connect(req, &matrix::JoinRequest::error, [=](const QString &msg) { qCritical() << tr("failed to join \"%1\": %2").arg(args).arg(msg); });
@@ -124,6 +165,10 @@ void RoomView::command(const QString &name, const QString &args) {
   }
 }
 
+void RoomView::jump_to(const matrix::EventID &event) {
+  timeline_manager_->jump_to(event);
+}
+
 void RoomView::selected() {
   timeline_view_->mark_read();
 }
@@ -133,6 +178,19 @@ void RoomView::send(const matrix::EventType &ty, const matrix::event::Content &c
                               std::chrono::time_point_cast<Time::duration>(std::chrono::system_clock::now()), ty, content);
 }
 
+void RoomView::update_read_markers() {
+  // Only buffered events are positioned, so those are the ones whose readers can be counted cheaply
+  std::unordered_map<matrix::EventID, std::size_t> markers;
+  for(const auto &batch : room_.buffer()) {
+    for(const auto &evt : batch.events) {
+      if(!room_.receipts_for(evt.id()).empty()) {
+        markers.emplace(evt.id(), room_.readers_at_or_after(evt.id()));
+      }
+    }
+  }
+  timeline_view_->set_read_markers(std::move(markers));
+}
+
 void RoomView::update_last_read() {
   auto r = room_.receipt_from(room_.session().user_id());
   if(!r) return;
@@ -17,6 +17,7 @@ class RoomState;
 enum class Membership;
 class TimelineManager;
 class UserID;
+class EventID;
 class EventType;
 class MemberListModel;
 
@@ -34,13 +35,14 @@ class TimelineView;
 class EntryBox;
 class MemberList;
 class ThumbnailCache;
+class MemoryBudget;
 
 class RoomView : public QWidget
 {
   Q_OBJECT
 
 public:
-  explicit RoomView(ThumbnailCache &cache, matrix::Room &room, QWidget *parent = nullptr);
+  RoomView(ThumbnailCache &cache, MemoryBudget &budget, matrix::Room &room, QWidget *parent = nullptr);
   ~RoomView();
 
   const matrix::Room &room() const { return room_; }
@@ -49,6 +51,9 @@ public:
   void selected();
   // Notify that user action has brought the room into view. Triggers read receipts.
 
+  void jump_to(const matrix::EventID &event);
+  // Show the timeline around event, fetching it if necessary
+
 private:
   Ui::RoomView *ui;
   TimelineView *timeline_view_;
@@ -61,6 +66,7 @@ private:
   void command(const QString &name, const QString &args);
   void send(const matrix::EventType &ty, const matrix::event::Content &content);
   void update_last_read();
+  void update_read_markers();
 };
 
 #endif // ROOMVIEW_H
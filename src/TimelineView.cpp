@@ -1,7 +1,12 @@
 #include "TimelineView.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <vector>
+#include <iterator>
+#include <tuple>
+#include <unordered_map>
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
@@ -9,7 +14,6 @@
 #include <QShortcut>
 #include <QPainter>
 #include <QScrollBar>
-#include <QRegularExpression>
 #include <QStringBuilder>
 #include <QGuiApplication>
 #include <QClipboard>
@@ -18,12 +22,15 @@
 #include <QMenu>
 #include <QDesktopServices>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QRunnable>
 
 #include <QDebug>
 
 #include "matrix/Room.hpp"
 
 #include "Spinner.hpp"
+#include "MemoryBudget.hpp"
 #include "RedactDialog.hpp"
 #include "EventSourceView.hpp"
 
@@ -32,7 +39,31 @@ using std::experimental::optional;
 namespace {
 
 constexpr std::chrono::minutes BLOCK_MERGE_INTERVAL(5);
+constexpr std::size_t COLLAPSE_RUN_LENGTH = 3; // Consecutive membership changes summarized as one line
 constexpr size_t DISCARD_PAGES_AWAY = 3; // Number of pages away a batch must be to be discarded
+constexpr qreal PREFETCH_PAGES = 1.5; // Pages of content to keep loaded past each edge of the view
+constexpr qreal PREFETCH_HORIZON = 1.5; // Seconds of scrolling at the current speed to additionally keep loaded ahead
+constexpr qreal VELOCITY_SMOOTHING = 0.2; // Seconds over which scroll velocity is averaged
+constexpr qint64 LAYOUT_BUDGET_MS = 4; // Time spent laying out off-screen blocks per idle iteration
+constexpr std::size_t BACKGROUND_LAYOUT_CHARS = 2000; // Blocks with more text than this are laid out off the GUI thread
+constexpr std::size_t LINE_CACHE_BYTES = 4 * 1024 * 1024;
+constexpr int TILE_HEIGHT = 512; // Logical pixels per strip of a block's tile; a whole number of pixels at common scales
+constexpr std::size_t EVENT_OVERHEAD_BYTES = 1024; // Parsed JSON and bookkeeping for an event, beyond its text
+constexpr std::size_t LAYOUT_BYTES_PER_CHAR = 48; // Glyphs and attributes of shaped text
+constexpr qreal REVERSAL_SPEED = 400; // Pixels per second away from an edge past which prefetching towards it stops
+
+// Calls f with each event and the state immediately preceding it, copying the state only if the events change it
+template<typename F>
+void with_states(const matrix::RoomState &initial, gsl::span<const matrix::event::Room> events, F &&f) {
+  optional<matrix::RoomState> scratch;
+  for(const auto &evt : events) {
+    f(scratch ? *scratch : initial, evt);
+    if(auto s = evt.to_state()) {
+      if(!scratch) scratch = initial;
+      scratch->apply(*s);
+    }
+  }
+}
 
 qreal block_spacing(const QWidget &parent) {
   return std::round(parent.fontMetrics().lineSpacing() * 0.75);
@@ -70,47 +101,6 @@ QTextCharFormat href_format(const QPalette &palette, const QString &href) {
   return format;
 }
 
-void href_urls(const QPalette &palette, QVector<QTextLayout::FormatRange> &formats, const QString &text, int offset = 0) {
-  const static QRegularExpression regex(
-    R"(\b()"
-    R"([a-z][a-z0-9+-.]*://[^\s]+)"
-    R"(|[^\s]+\.(com|net|org)(/[^\s]*)?)"
-    R"(|www\.[^\s]+\.[^\s]+)"
-    R"(|data:[^\s]+)"
-    R"())",
-    QRegularExpression::UseUnicodePropertiesOption | QRegularExpression::OptimizeOnFirstUsageOption | QRegularExpression::CaseInsensitiveOption);
-
-  auto urls = regex.globalMatch(text, offset);
-  while(urls.hasNext()) {
-    auto candidate = urls.next();
-    // QUrl doesn't handle some things consistently (e.g. emoticons in .la) so we round-trip it
-    QUrl url(QUrl(candidate.captured(), QUrl::StrictMode).toString(QUrl::FullyEncoded), QUrl::StrictMode);
-    if(!url.isValid()) continue;
-    if(url.scheme().isEmpty()) url = QUrl("http://" + url.toString(QUrl::FullyEncoded), QUrl::StrictMode);
-
-    QTextLayout::FormatRange range;
-    range.start = candidate.capturedStart();
-    range.length = candidate.capturedLength();
-    range.format = href_format(palette, url.toString(QUrl::FullyEncoded));
-    formats.push_back(range);
-  }
-}
-
-QVector<QTextLayout::FormatRange> format_view(const QVector<QTextLayout::FormatRange> &formats, int start, int length) {
-  const auto end = start + length;
-  QVector<QTextLayout::FormatRange> result;
-  for(const auto &in : formats) {
-    const auto in_end = in.start + in.length;
-    if(in_end <= start || end <= in.start) continue;
-    QTextLayout::FormatRange out;
-    out.format = in.format;
-    out.start = in.start - start;
-    out.length = in.length;
-    result.push_back(out);
-  }
-  return result;
-}
-
 optional<matrix::UserID> get_affected_user(const matrix::event::Room &e) {
   if(e.type() != matrix::event::room::Member::tag()) return {};
   matrix::event::room::Member member_evt{matrix::event::room::State{e}};
@@ -123,6 +113,57 @@ optional<matrix::EventID> get_redacts(const matrix::event::Room &e) {
   return re.redacts();
 }
 
+// Approximate memory an event holds once displayed, including its share of its block's layout
+std::size_t footprint(const EventLike &e) {
+  const auto body = e.content().json()["body"];
+  const std::size_t chars = body.isString() ? body.toString().size() : 0;
+  // Text is held both as JSON and for display
+  return sizeof(EventLike) + EVENT_OVERHEAD_BYTES + chars * (2 * sizeof(QChar) + LAYOUT_BYTES_PER_CHAR);
+}
+
+bool is_membership(const EventLike &e) {
+  return e.type == matrix::event::room::Member::tag();
+}
+
+// e.g. "12 joined, 4 left"
+QString membership_summary(gsl::span<const EventLike *const> events) {
+  int joined = 0, left = 0, invited = 0, banned = 0, changed = 0;
+  for(const auto event : events) {
+    try {
+      const matrix::event::room::MemberContent content{event->content()};
+      switch(content.membership()) {
+      case matrix::Membership::INVITE:
+        ++invited;
+        break;
+      case matrix::Membership::JOIN: {
+        const auto affected = event->affected_user();
+        if(affected && affected->member && affected->member->membership() == matrix::Membership::JOIN) {
+          ++changed;
+        } else {
+          ++joined;
+        }
+        break;
+      }
+      case matrix::Membership::LEAVE:
+        ++left;
+        break;
+      case matrix::Membership::BAN:
+        ++banned;
+        break;
+      }
+    } catch(const matrix::malformed_event &) {}
+  }
+
+  QStringList parts;
+  if(joined) parts << TimelineView::tr("%n joined", "", joined);
+  if(left) parts << TimelineView::tr("%n left", "", left);
+  if(invited) parts << TimelineView::tr("%n invited", "", invited);
+  if(banned) parts << TimelineView::tr("%n banned", "", banned);
+  if(changed) parts << TimelineView::tr("%n changed profile", "", changed);
+  if(parts.empty()) return TimelineView::tr("%n membership changes", "", static_cast<int>(events.size()));
+  return parts.join(", ");
+}
+
 void populate_menu_href(QMenu &menu, const QUrl &homeserver, const QString &href) {
   menu.addSection(TimelineView::tr("Link"));
   const QUrl url(href);
@@ -163,46 +204,73 @@ void populate_menu_event(QMenu &menu, TimelineView &view, const matrix::event::R
 
 }
 
-EventLike::EventLike(TimelineEventID id, const matrix::RoomState &state, matrix::event::Room real)
-  : EventLike(id, state, real.sender(), to_time_point(real.origin_server_ts()), real.type(), real.content(), get_affected_user(real), get_redacts(real))
+static bool same_member(const optional<matrix::event::room::MemberContent> &a,
+                        const optional<matrix::event::room::MemberContent> &b) {
+  if(!a || !b) return !a && !b;
+  return a->membership() == b->membership() && a->displayname() == b->displayname() && a->avatar_url() == b->avatar_url();
+}
+
+std::shared_ptr<const Profile> InternTable::profile(const matrix::RoomState &state, const matrix::UserID &user) {
+  optional<matrix::event::room::MemberContent> member;
+  optional<QString> disambiguation;
+  if(auto m = state.member_from_id(user)) {
+    member = *m;
+    disambiguation = state.member_disambiguation(user);
+  }
+
+  auto &latest = profiles_[user];
+  if(!latest || !same_member(latest->member, member) || latest->disambiguation != disambiguation) {
+    latest = std::make_shared<const Profile>(Profile{user, std::move(member), std::move(disambiguation)});
+  }
+  return latest;
+}
+
+matrix::EventType InternTable::type(const matrix::EventType &type) {
+  return *types_.insert(type).first;
+}
+
+EventLike::EventLike(TimelineEventID id, InternTable &interned, const matrix::RoomState &state, matrix::event::Room real)
+  : EventLike(id, interned, state, real.sender(), to_time_point(real.origin_server_ts()), real.type(), matrix::event::Content{QJsonObject{}},
+              get_affected_user(real))
 {
   event = std::move(real);
 }
 
-EventLike::EventLike(TimelineEventID id, const matrix::RoomState &state,
+EventLike::EventLike(TimelineEventID id, InternTable &interned, const matrix::RoomState &state,
                      const matrix::UserID &sender, Time time, matrix::EventType type, matrix::event::Content content,
-                     optional<matrix::UserID> affected_user, optional<matrix::EventID> redacts)
-  : id{id}, type{std::move(type)}, time{time}, sender{sender}, redacts{redacts}, content{std::move(content)}, read{false}
-{
-  if(affected_user) {
-    auto m = state.member_from_id(*affected_user);
-    affected_user_info = MemberInfo{*affected_user, m ? *m : matrix::event::room::MemberContent::leave};
-  }
+                     optional<matrix::UserID> affected_user)
+  : id{id}, type{interned.type(type)}, sender_{interned.profile(state, sender)},
+    affected_{affected_user ? interned.profile(state, *affected_user) : nullptr}, local_content_{content.json()},
+    time_{time}, flags_{TIMED}
+{}
+
+optional<Time> EventLike::time() const {
+  if(flags_ & TIMED) return time_;
+  return {};
+}
 
-  auto member = state.member_from_id(sender);
-  if(member) {
-    disambiguation = state.member_disambiguation(sender);
-    member_content = *member;
-  }
+optional<matrix::EventID> EventLike::redacts() const {
+  if(!event) return {};
+  return get_redacts(*event);
 }
 
 optional<matrix::event::room::MemberContent> EventLike::effective_profile() const {
   // Events concerning non-present users use the profile they set, whereas all others use the previously set one, if any
-  if(affected_user_info && affected_user_info->user == sender) {
-    matrix::event::room::MemberContent mc{content};
-    if(affected_user_info->prev_content.membership() == matrix::Membership::LEAVE
-       || affected_user_info->prev_content.membership() == matrix::Membership::BAN) {
+  if(affected_ && affected_->user == sender()) {
+    matrix::event::room::MemberContent mc{content()};
+    const auto prev = affected_->member ? affected_->member->membership() : matrix::Membership::LEAVE;
+    if(prev == matrix::Membership::LEAVE || prev == matrix::Membership::BAN) {
       return mc;
     }
   }
-  return member_content;
+  return member_content();
 }
 
 void EventLike::redact(const matrix::event::room::Redaction &because) {
   if(!event) throw std::logic_error("tried to redact a fake event");
   event->redact(because);
-  time = {};
-  content = event->content();
+  flags_ &= ~TIMED;
+  text.reset();
 }
 
 optional<matrix::event::room::Redaction> EventLike::redaction() const {
@@ -212,11 +280,23 @@ optional<matrix::event::room::Redaction> EventLike::redaction() const {
   return {};
 }
 
-EventBlock::EventBlock(TimelineView &parent, ThumbnailCache &thumbnail_cache, gsl::span<const EventLike *const> events)
-  : parent_{parent}, sender_{events[0]->sender}, events_{static_cast<std::size_t>(events.size())}
+EventBlock::EventBlock(TimelineView &parent, ThumbnailCache &thumbnail_cache, gsl::span<const EventLike *const> events,
+                       bool collapsed)
+  : parent_{parent}, sender_{events[0]->sender()}, events_{static_cast<std::size_t>(events.size())},
+    first_source_{events[0]->id}, source_count_{static_cast<std::size_t>(events.size())}, collapsed_{collapsed},
+    layout_width_{-1}, estimate_width_{-1}, estimate_{0}, text_size_{0}
 {
   const auto &front = *events[0];
 
+  if(collapsed_) {
+    // No header; the summary stands alone
+    name_.setFont(parent_.font());
+    timestamp_.setFont(parent_.font());
+    events_.emplace_back(parent, front, *events[events.size()-1], membership_summary(events));
+    text_size_ = events_.front().paragraphs.front().text().size();
+    return;
+  }
+
   if(auto p = front.effective_profile()) {
     if(auto avatar = p->avatar_url()) {
       const auto size = static_cast<int>(std::floor(avatar_extent())) * parent_.devicePixelRatio();
@@ -224,13 +304,13 @@ EventBlock::EventBlock(TimelineView &parent, ThumbnailCache &thumbnail_cache, gs
         avatar_ = ThumbnailRef{matrix::Thumbnail{matrix::Content{*avatar}, QSize{size, size}, matrix::ThumbnailMethod::SCALE},
                                thumbnail_cache};
       } catch(const matrix::illegal_content_scheme &) {
-        qDebug() << "illegal content in avatar url" << *avatar << "for user" << front.sender.value();
+        qDebug() << "illegal content in avatar url" << *avatar << "for user" << front.sender().value();
       }
     }
   }
 
-  if(front.time) {
-    time_ = TimeInfo{*events[0]->time, *events[events.size()-1]->time};
+  if(front.time()) {
+    time_ = TimeInfo{*events[0]->time(), *events[events.size()-1]->time()};
   }
 
   {
@@ -242,8 +322,8 @@ EventBlock::EventBlock(TimelineView &parent, ThumbnailCache &thumbnail_cache, gs
     if(auto p = front.effective_profile()) {
       displayname = p->displayname();
     }
-    name_.setText((displayname ? *displayname : front.sender.value())
-                  + (front.disambiguation ? QString(" (" % *front.disambiguation % ")") : ""));
+    name_.setText((displayname ? *displayname : front.sender().value())
+                  + (front.disambiguation() ? QString(" (" % *front.disambiguation() % ")") : ""));
     name_.setFont(parent_.font());
     name_.setTextOption(options);
     name_.setCacheEnabled(true);
@@ -262,30 +342,140 @@ EventBlock::EventBlock(TimelineView &parent, ThumbnailCache &thumbnail_cache, gs
     try {
       events_.emplace_back(parent, *this, *events[i]);
     } catch(const matrix::malformed_event &e) {
-      qDebug() << "skipping malformed event (" << e.what() << ") with content " << events[i]->content.json();
+      qDebug() << "skipping malformed event (" << e.what() << ") with content " << events[i]->content().json();
+    }
+  }
+
+  for(const auto &event : events_) {
+    for(const auto &paragraph : event.paragraphs) {
+      text_size_ += paragraph.text().size();
     }
   }
 }
 
-void EventBlock::update_layout(qreal width) {
+// Lines after the second are indented by rest_offset rather than first_offset, to flow underneath the avatar
+static void lay_out_text(QTextLayout &layout, std::size_t &lines, qreal width, qreal first_offset, qreal rest_offset,
+                         qreal line_spacing) {
+  layout.beginLayout();
+  while(true) {
+    auto line = layout.createLine();
+    if(!line.isValid()) break;
+    qreal offset = (lines < 2) ? first_offset : rest_offset;
+    line.setLineWidth(width - offset);
+    line.setPosition(QPointF(offset, lines * line_spacing));
+    lines += 1;
+  }
+  layout.endLayout();
+}
+
+static LineCache::Key line_key(const EventBlock::Event &event, std::size_t paragraph, const QTextLayout &layout,
+                               const QString &font, qreal width, std::size_t first_line) {
+  return LineCache::Key{event.source ? event.source->id().value() : QString(), event.source ? 0 : event.id.value(),
+                        paragraph, qHash(layout.text()), font, width, std::min<std::size_t>(first_line, 2)};
+}
+
+static std::vector<int> line_lengths(const QTextLayout &layout) {
+  std::vector<int> result;
+  result.reserve(layout.lineCount());
+  for(int i = 0; i < layout.lineCount(); ++i) {
+    result.push_back(layout.lineAt(i).textLength());
+  }
+  return result;
+}
+
+// As lay_out_text, but reusing line breaks found by an earlier layout of the same text at the same width if possible
+static void lay_out_cached(QTextLayout &layout, LineCache &cache, const LineCache::Key &key, std::size_t &lines, qreal width,
+                           qreal first_offset, qreal rest_offset, qreal line_spacing) {
+  const auto cached = cache.find(key);
+  if(!cached) {
+    lay_out_text(layout, lines, width, first_offset, rest_offset, line_spacing);
+    cache.insert(key, line_lengths(layout));
+    return;
+  }
+
+  layout.beginLayout();
+  for(const int length : *cached) {
+    auto line = layout.createLine();
+    if(!line.isValid()) break;
+    qreal offset = (lines < 2) ? first_offset : rest_offset;
+    line.setNumColumns(length, width - offset);
+    line.setPosition(QPointF(offset, lines * line_spacing));
+    lines += 1;
+  }
+  layout.endLayout();
+}
+
+// Number of lines the sender's name will occupy, i.e. where the body begins
+static std::size_t header_lines(const QString &name, const QFont &font, const QTextOption &option, qreal width, qreal early_offset,
+                                qreal line_spacing) {
+  QTextLayout layout(name, font);
+  layout.setTextOption(option);
+  std::size_t lines = 0;
+  lay_out_text(layout, lines, width, early_offset, 0, line_spacing);
+  return lines;
+}
+
+// Immutable inputs to and results of laying out a block's paragraphs off the GUI thread
+struct EventBlock::Shaping {
+  struct Paragraph {
+    QString text;
+    QVector<QTextLayout::FormatRange> formats;
+    QTextOption option;
+  };
+
+  qreal width, early_offset, padding, line_spacing;
+  QFont font;
+  bool header;
+  QString name;
+  QTextOption name_option;
+  std::vector<std::vector<Paragraph>> events;
+
+  std::vector<FixedVector<QTextLayout>> paragraphs; // Per event, written by the worker
+  std::atomic<bool> done{false};
+};
+
+class EventBlock::Shaper : public QRunnable {
+public:
+  Shaper(TimelineView &view, std::shared_ptr<Shaping> shaping) : view_(view), shaping_{std::move(shaping)} {}
+
+  void run() override {
+    auto &s = *shaping_;
+    // The real header is cheap enough to lay out on adoption
+    std::size_t lines = s.header ? header_lines(s.name, s.font, s.name_option, s.width, s.early_offset, s.line_spacing) : 0;
+
+    s.paragraphs.reserve(s.events.size());
+    for(const auto &event : s.events) {
+      FixedVector<QTextLayout> paragraphs(event.size());
+      for(const auto &input : event) {
+        paragraphs.emplace_back(input.text, s.font);
+        auto &paragraph = paragraphs.back();
+        paragraph.setFormats(input.formats);
+        paragraph.setTextOption(input.option);
+        paragraph.setCacheEnabled(true);
+        lay_out_text(paragraph, lines, s.width, s.early_offset, s.padding, s.line_spacing);
+      }
+      s.paragraphs.push_back(std::move(paragraphs));
+    }
+
+    s.done = true;
+    view_.shaped();
+  }
+
+private:
+  TimelineView &view_;
+  std::shared_ptr<Shaping> shaping_;
+};
+
+std::size_t EventBlock::lay_out_header(qreal width) {
+  if(collapsed_) return 0;
+
   const auto &metrics = parent_.fontMetrics();
 
   // Header and first line
   const qreal early_offset = avatar_extent() + horizontal_padding();
 
-  size_t lines = 0;
-  {
-    name_.beginLayout();
-    while(true) {
-      auto line = name_.createLine();
-      if(!line.isValid()) break;
-      qreal offset = (lines < 2) * early_offset;
-      line.setLineWidth(width - offset);
-      line.setPosition(QPointF(offset, lines * metrics.lineSpacing()));
-      lines += 1;
-    }
-    name_.endLayout();
-  }
+  std::size_t lines = 0;
+  lay_out_text(name_, lines, width, early_offset, 0, metrics.lineSpacing());
 
   {
     // Lay out as a single or range timestamp as appropriate, degrading to single or nothing of space in the header is unavailable
@@ -319,23 +509,116 @@ void EventBlock::update_layout(qreal width) {
     }
   }
 
+  return lines;
+}
+
+void EventBlock::update_layout(qreal width) {
+  shaping_.reset();             // Superseded
+  if(width == layout_width_) return;
+  layout_width_ = width;
+  tile_ = {};
+
+  auto lines = lay_out_header(width);
+  const qreal early_offset = avatar_extent() + horizontal_padding();
+  const qreal line_spacing = parent_.fontMetrics().lineSpacing();
+  const auto font = parent_.font().key();
+  auto &cache = parent_.line_cache();
   for(auto &event : events_) {
+    std::size_t index = 0;
     for(auto &paragraph : event.paragraphs) {
-      paragraph.beginLayout();
-      while(true) {
-        auto line = paragraph.createLine();
-        if(!line.isValid()) break;
-        qreal offset = (lines < 2) ? early_offset : horizontal_padding();
-        line.setLineWidth(width - offset);
-        line.setPosition(QPointF(offset, lines * metrics.lineSpacing()));
-        lines += 1;
-      }
-      paragraph.endLayout();
+      lay_out_cached(paragraph, cache, line_key(event, index, paragraph, font, width, lines), lines, width,
+                     early_offset, horizontal_padding(), line_spacing);
+      ++index;
+    }
+  }
+}
+
+bool EventBlock::layout_cached(qreal width) {
+  const qreal early_offset = avatar_extent() + horizontal_padding();
+  const qreal line_spacing = parent_.fontMetrics().lineSpacing();
+  const auto font = parent_.font().key();
+  auto &cache = parent_.line_cache();
+  std::size_t lines = collapsed_ ? 0 : header_lines(name_.text(), name_.font(), name_.textOption(), width, early_offset, line_spacing);
+  for(const auto &event : events_) {
+    std::size_t index = 0;
+    for(const auto &paragraph : event.paragraphs) {
+      const auto cached = cache.find(line_key(event, index, paragraph, font, width, lines));
+      if(!cached) return false;
+      lines += cached->size();
+      ++index;
+    }
+  }
+  return true;
+}
+
+void EventBlock::request_layout(QThreadPool &pool, qreal width) {
+  if(width == layout_width_ || (shaping_ && shaping_->width == width)) return;
+
+  auto s = std::make_shared<Shaping>();
+  s->width = width;
+  s->early_offset = avatar_extent() + horizontal_padding();
+  s->padding = horizontal_padding();
+  s->line_spacing = parent_.fontMetrics().lineSpacing();
+  s->font = parent_.font();
+  s->header = !collapsed_;
+  s->name = name_.text();
+  s->name_option = name_.textOption();
+  s->events.reserve(events_.size());
+  for(const auto &event : events_) {
+    s->events.emplace_back();
+    auto &paragraphs = s->events.back();
+    paragraphs.reserve(event.paragraphs.size());
+    for(const auto &paragraph : event.paragraphs) {
+      paragraphs.push_back(Shaping::Paragraph{paragraph.text(), paragraph.formats(), paragraph.textOption()});
     }
   }
+
+  shaping_ = s;
+  pool.start(new Shaper(parent_, std::move(s)));
+}
+
+bool EventBlock::adopt_layout() {
+  if(!shaping_ || !shaping_->done) return false;
+  auto s = std::move(shaping_);
+  auto lines = lay_out_header(s->width);
+  const auto font = s->font.key();
+  auto &cache = parent_.line_cache();
+  for(std::size_t i = 0; i < events_.size(); ++i) {
+    auto &event = events_[i];
+    event.paragraphs = std::move(s->paragraphs[i]);
+    std::size_t index = 0;
+    for(const auto &paragraph : event.paragraphs) {
+      cache.insert(line_key(event, index, paragraph, font, s->width, lines), line_lengths(paragraph));
+      lines += paragraph.lineCount();
+      ++index;
+    }
+  }
+  layout_width_ = s->width;
+  tile_ = {};
+  return true;
+}
+
+qreal EventBlock::estimate_height(qreal width) const {
+  if(width == estimate_width_) return estimate_;
+  const auto &metrics = parent_.fontMetrics();
+  const qreal text_width = std::max<qreal>(1, width - horizontal_padding());
+  const qreal char_width = metrics.averageCharWidth();
+  std::size_t lines = !collapsed_; // Header
+  for(const auto &event : events_) {
+    for(const auto &paragraph : event.paragraphs) {
+      lines += std::max<std::size_t>(1, std::ceil(paragraph.text().size() * char_width / text_width));
+    }
+  }
+  estimate_ = collapsed_ ? lines * metrics.lineSpacing() : std::max<qreal>(avatar_extent(), lines * metrics.lineSpacing());
+  estimate_width_ = width;
+  return estimate_;
 }
 
 QRectF EventBlock::bounds() const {
+  if(collapsed_) {
+    const auto summary = events_.front().paragraphs.front().boundingRect();
+    return QRectF(QPointF(0, 0), summary.bottomRight());
+  }
   // We assume that name_ overlaps timestamp_ and that all paragraphs have equal width.
   return QRectF(0, 0, avatar_extent(), avatar_extent()) | name_.boundingRect() | events_.back().paragraphs.back().boundingRect();
 }
@@ -475,6 +758,31 @@ bool EventBlock::draw(QPainter &p, bool bottom_selected, const Selection &select
 }
 
 void EventBlock::handle_input(const QPointF &point, QEvent *input) {
+  if(collapsed_) {
+    // The summary acts as a button
+    const bool over = events_.front().bounds().contains(point);
+    switch(input->type()) {
+    case QEvent::MouseButtonPress:
+      input->setAccepted(over);
+      break;
+    case QEvent::MouseButtonRelease:
+      input->setAccepted(over);
+      if(over) parent_.expand_run(first_source_);
+      break;
+    case QEvent::MouseMove:
+      parent_.setCursor(over ? Qt::PointingHandCursor : Qt::ArrowCursor);
+      input->setAccepted(over);
+      break;
+    case QEvent::ToolTip:
+      QToolTip::showText(static_cast<QHelpEvent*>(input)->globalPos(), TimelineView::tr("Click to show each event"));
+      break;
+    default:
+      input->ignore();
+      break;
+    }
+    return;
+  }
+
   const QRectF avatar_rect(0, 0, avatar_extent(), avatar_extent());
 
   switch(input->type()) {
@@ -624,7 +932,7 @@ static optional<QString> href_at(const QTextLayout &layout, int cursor) {
 
 optional<CursorWithHref> EventBlock::get_cursor(const QPointF &point, bool exact) const {
   auto header_rect = name_.boundingRect();
-  if(point.y() < header_rect.bottom()) {
+  if(!collapsed_ && point.y() < header_rect.bottom()) {
     if(timestamp_.lineCount() != 0) {
       const auto line = timestamp_.lineAt(0);
       const auto rect = line.naturalTextRect();
@@ -709,13 +1017,14 @@ bool EventBlock::has(TimelineEventID event) const {
   return false;
 }
 
-EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, const EventLike &e)
-  : id{e.id}, type{e.type}, redacted{e.redaction()}, time{e.time}, source{e.event} {
+namespace {
 
+EventText event_text(const EventLike &e, const QString &name) {
   const auto &&tr = [](const char *s) { return TimelineView::tr(s); };
 
+  EventText result;
   QString text;
-  QVector<QTextLayout::FormatRange> formats;
+  std::vector<Link> links;
 
   using namespace matrix::event::room;
 
@@ -739,13 +1048,14 @@ EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, cons
         text = tr("REDACTED");
       }
     } else {
-      MessageContent msg{e.content};
+      MessageContent msg{e.content()};
       if(msg.type() == message::Text::tag() || msg.type() == message::Notice::tag()) {
         text = msg.body();
-        href_urls(view.palette(), formats, text);
+        links = find_links(text);
       } else if(msg.type() == message::Emote::tag()) {
-        text = QString("* %1 %2").arg(block.name_.text()).arg(msg.body());
-        href_urls(view.palette(), formats, text, block.name_.text().size() + 3);
+        text = QString("* %1 %2").arg(name).arg(msg.body());
+        links = find_links(text, name.size() + 3);
+        result.name = name;
       } else if(msg.type() == matrix::event::room::message::File::tag()
                 || msg.type() == matrix::event::room::message::Image::tag()
                 || msg.type() == matrix::event::room::message::Video::tag()
@@ -756,13 +1066,7 @@ EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, cons
         } else {
           text = file.body();
         }
-        {
-          QTextLayout::FormatRange range;
-          range.start = 0;
-          range.length = text.length();
-          range.format = href_format(view.palette(), file.url());
-          formats.push_back(range);
-        }
+        links.push_back(Link{0, text.length(), file.url()});
         auto type = file.mimetype();
         auto size = file.size();
         if(type || size)
@@ -778,14 +1082,14 @@ EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, cons
       } else {
         qDebug() << "displaying fallback for unrecognized msgtype:" << msg.type().value();
         text = msg.body();
-        href_urls(view.palette(), formats, text);
+        links = find_links(text);
       }
     }
   } else if(e.type == Member::tag()) {
-    const MemberContent content{e.content};
-    const MemberContent prev_content{e.affected_user_info->prev_content};
-    const matrix::UserID &user = e.affected_user_info->user;
-    if(user == block.sender_) {
+    const MemberContent content{e.content()};
+    const MemberContent prev_content{e.affected_user()->member.value_or(MemberContent::leave)};
+    const matrix::UserID &user = e.affected_user()->user;
+    if(user == e.sender()) {
       switch(content.membership()) {
       case matrix::Membership::INVITE:
         text = tr("invited themselves");
@@ -861,7 +1165,7 @@ EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, cons
     }
     redaction_note();
   } else if(e.type == Name::tag()) {
-    const auto n = NameContent{e.content}.name();
+    const auto n = NameContent{e.content()}.name();
     if(n) {
       text = tr("set the room name to \"%1\"").arg(*n);
     } else {
@@ -879,40 +1183,97 @@ EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, cons
         text = tr("redacted REDACTED");
       }
     } else {
-      auto reason = RedactionContent{e.content}.reason();
+      auto reason = RedactionContent{e.content()}.reason();
       // TODO: Clickable event ID
       if(reason) {
-        text = tr("redacted %1: %2").arg(e.redacts->value()).arg(*reason);
+        text = tr("redacted %1: %2").arg(e.redacts()->value()).arg(*reason);
       } else {
-        text = tr("redacted %1").arg(e.redacts->value());
+        text = tr("redacted %1").arg(e.redacts()->value());
       }
     }
   } else {
     text = tr("unrecognized message type %1").arg(e.type.value());
   }
 
-  const static QRegularExpression line_re("\\R", QRegularExpression::UseUnicodePropertiesOption | QRegularExpression::OptimizeOnFirstUsageOption);
-  auto lines = text.split(line_re);
 
+  // Split into paragraphs at any line break, as the regex \R would
+  auto add_paragraph = [&](int start, int end) {
+    EventText::Paragraph paragraph;
+    paragraph.text = text.mid(start, end - start);
+    for(const auto &link : links) {
+      if(link.start + link.length <= start || end <= link.start) continue;
+      paragraph.links.push_back(Link{link.start - start, link.length, link.href});
+    }
+    result.paragraphs.push_back(std::move(paragraph));
+  };
+  int start = 0;
+  for(int i = 0; i < text.size(); ++i) {
+    const auto c = text[i].unicode();
+    if(c == '\r' && i + 1 < text.size() && text[i+1] == '\n') {
+      add_paragraph(start, i);
+      start = i + 2;
+      ++i;
+    } else if(c == '\n' || c == '\v' || c == '\f' || c == '\r' || c == 0x85 || c == 0x2028 || c == 0x2029) {
+      add_paragraph(start, i);
+      start = i + 1;
+    }
+  }
+  add_paragraph(start, text.size());
+
+  return result;
+}
+
+}
+
+EventBlock::Event::Event(const TimelineView &view, const EventBlock &block, const EventLike &e)
+  : id{e.id}, type{e.type}, redacted{e.redaction()}, time{e.time()}, source{e.event} {
+  if(!e.text || (e.text->name && *e.text->name != block.name_.text())) {
+    e.text = std::make_shared<const EventText>(event_text(e, block.name_.text()));
+  }
 
   QTextOption body_options;
   body_options.setAlignment(Qt::AlignLeft | Qt::AlignTop);
   body_options.setWrapMode(QTextOption::WrapAtWordBoundaryOrAnywhere);
 
-  paragraphs = FixedVector<QTextLayout>(lines.size());
-  size_t start = 0;
-  for(int i = 0; i < lines.size(); ++i) {
-    paragraphs.emplace_back(lines[i], view.font());
+  paragraphs = FixedVector<QTextLayout>(e.text->paragraphs.size());
+  for(const auto &p : e.text->paragraphs) {
+    paragraphs.emplace_back(p.text, view.font());
     auto &paragraph = paragraphs.back();
 
-    paragraph.setFormats(format_view(formats, start, lines[i].length()));
+    QVector<QTextLayout::FormatRange> formats;
+    formats.reserve(p.links.size());
+    for(const auto &link : p.links) {
+      QTextLayout::FormatRange range;
+      range.start = link.start;
+      range.length = link.length;
+      range.format = href_format(view.palette(), link.href);
+      formats.push_back(range);
+    }
+    paragraph.setFormats(formats);
     paragraph.setTextOption(body_options);
     paragraph.setCacheEnabled(true);
-
-    start += 1 + lines[i].size();
   }
 }
 
+EventBlock::Event::Event(const TimelineView &view, const EventLike &first, const EventLike &last, const QString &summary)
+  : id{first.id}, type{first.type}, redacted{false}, time{last.time()}, source{last.event}, paragraphs{1} {
+  QTextOption options;
+  options.setAlignment(Qt::AlignLeft | Qt::AlignTop);
+  options.setWrapMode(QTextOption::WrapAtWordBoundaryOrAnywhere);
+
+  paragraphs.emplace_back(summary, view.font());
+  auto &paragraph = paragraphs.back();
+  QTextCharFormat format;
+  format.setFontUnderline(true);
+  QTextLayout::FormatRange range;
+  range.start = 0;
+  range.length = summary.size();
+  range.format = format;
+  paragraph.setFormats(QVector<QTextLayout::FormatRange>{range});
+  paragraph.setTextOption(options);
+  paragraph.setCacheEnabled(true);
+}
+
 QRectF EventBlock::Event::bounds() const {
   QRectF bounds;
   for(const auto &paragraph : paragraphs) {
@@ -921,9 +1282,12 @@ QRectF EventBlock::Event::bounds() const {
   return bounds;
 }
 
-TimelineView::TimelineView(const QUrl &homeserver, ThumbnailCache &cache, QWidget *parent)
-  : QAbstractScrollArea{parent}, homeserver_{homeserver}, thumbnail_cache_{cache}, selection_updating_{false}, click_count_{0},
-    copy_{new QShortcut(QKeySequence::Copy, this)}, at_bottom_{false}, id_counter_{0}, blocks_dirty_{false} {
+TimelineView::TimelineView(const QUrl &homeserver, ThumbnailCache &cache, MemoryBudget &budget, QWidget *parent)
+  : QAbstractScrollArea{parent}, homeserver_{homeserver}, thumbnail_cache_{cache}, budget_{budget}, event_bytes_{0},
+    selection_updating_{false}, click_count_{0},
+    copy_{new QShortcut(QKeySequence::Copy, this)}, at_bottom_{false}, id_counter_{0}, blocks_dirty_{false},
+    scroll_velocity_{0}, last_scroll_value_{0}, last_scroll_time_{std::chrono::steady_clock::now()}, adjusting_scroll_{false},
+    event_height_estimate_{0}, line_cache_{LINE_CACHE_BYTES} {
   setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
   setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
   verticalScrollBar()->setSingleStep(20);  // Taken from QScrollArea
@@ -934,7 +1298,12 @@ TimelineView::TimelineView(const QUrl &homeserver, ThumbnailCache &cache, QWidge
   policy.setVerticalStretch(0);
   setSizePolicy(policy);
 
-  connect(verticalScrollBar(), &QAbstractSlider::valueChanged, [this]() {
+  layout_timer_.setSingleShot(true);
+  connect(&layout_timer_, &QTimer::timeout, this, &TimelineView::refine_layout);
+  connect(this, &TimelineView::shaped, this, &TimelineView::collect_shaped, Qt::QueuedConnection);
+
+  connect(verticalScrollBar(), &QAbstractSlider::valueChanged, [this](int value) {
+      track_scroll(value);
       compute_visible_blocks();
       if(selection_updating_ && QGuiApplication::mouseButtons() & Qt::LeftButton) {
         selection_dragged(view_rect().topLeft() + QPointF{mapFromGlobal(QCursor::pos())});
@@ -942,7 +1311,9 @@ TimelineView::TimelineView(const QUrl &homeserver, ThumbnailCache &cache, QWidge
     });
   connect(copy_, &QShortcut::activated, this, &TimelineView::copy);
 
-  connect(&thumbnail_cache_, &ThumbnailCache::updated, viewport(), static_cast<void (QWidget::*)()>(&QWidget::update));
+  connect(&thumbnail_cache_, &ThumbnailCache::updated, this, &TimelineView::thumbnails_updated);
+  // Queued, since the budget is exceeded while some view is in the middle of growing
+  connect(&budget_, &MemoryBudget::exceeded, this, &TimelineView::enforce_budget, Qt::QueuedConnection);
 
   {
     const int extent = devicePixelRatioF() * spinner_space() * .9;
@@ -955,80 +1326,141 @@ TimelineView::TimelineView(const QUrl &homeserver, ThumbnailCache &cache, QWidge
   }
 }
 
-void TimelineView::prepend(const matrix::TimelineCursor &begin, const matrix::RoomState &state, const matrix::event::Room &evt) {
-  const bool next_read = batches_.empty() ? false : batches_.front().events.front().read;
+void TimelineView::prepend(const matrix::TimelineCursor &begin, const matrix::RoomState &state, gsl::span<const matrix::event::Room> events) {
+  if(events.empty()) return;
+
+  const bool next_read = batches_.empty() ? false : batches_.front().events.front().read();
+  std::deque<EventLike> new_events;
+  with_states(state, events, [&](const matrix::RoomState &s, const matrix::event::Room &evt) {
+      take_pending(evt);
+      new_events.emplace_back(get_id(), interned_, s, evt);
+      new_events.back().set_read(next_read);
+    });
+
+  const auto count = new_events.size();
   if(!batches_.empty() && batches_.front().begin == begin) {
-    batches_.front().events.emplace_front(get_id(), state, evt);
+    auto &front = batches_.front().events;
+    front.insert(front.begin(), std::make_move_iterator(new_events.begin()), std::make_move_iterator(new_events.end()));
   } else {
-    batches_.emplace_front(begin, std::deque<EventLike>{EventLike{get_id(), state, evt}});
-  }
-  batches_.front().events.front().read = next_read;
-
-  if(auto u = evt.unsigned_data()) {
-    if(auto txid = u->transaction_id()) {
-      pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
-                                    [&](const Pending &p) { return p.transaction == *txid; }),
-                     pending_.end());
-    }
+    batches_.emplace_front(begin, std::move(new_events));
   }
+  auto &front = batches_.front();
+  index(front, front.events.begin(), front.events.begin() + count);
 
   mark_dirty();
 }
 
-void TimelineView::append(const matrix::TimelineCursor &begin, const matrix::RoomState &state, const matrix::event::Room &evt) {
-  optional<TimelineEventID> existing_id;
-  if(auto u = evt.unsigned_data()) {
-    if(auto txid = u->transaction_id()) {
-      auto it = std::find_if(pending_.cbegin(), pending_.cend(), [&](const Pending &x) { return x.transaction == *txid; });
-      if(it != pending_.cend()) {
-        existing_id = it->event.id;
-        pending_.erase(it);
+void TimelineView::append(const matrix::TimelineCursor &begin, const matrix::RoomState &state, gsl::span<const matrix::event::Room> events) {
+  if(events.empty()) return;
+
+  bool prev_read = false, prev_last_read = false;
+  if(!batches_.empty()) {
+    const auto &prev = batches_.back().events.back();
+    prev_read = prev.read();
+    prev_last_read = last_read_ && prev.event && prev.event->id() == *last_read_;
+  }
+  if(batches_.empty() || batches_.back().begin != begin) {
+    batches_.emplace_back(begin, std::deque<EventLike>{});
+  }
+  auto &batch = batches_.back().events;
+
+  with_states(state, events, [&](const matrix::RoomState &s, const matrix::event::Room &evt) {
+      const auto existing_id = take_pending(evt);
+      if(existing_id) stale_events_.insert(*existing_id); // The echo is replaced by the real event
+      batch.emplace_back(existing_id ? *existing_id : get_id(), interned_, s, evt);
+      index(batches_.back(), std::prev(batch.end()), batch.end());
+      batch.back().set_read(!prev_last_read && prev_read);
+      prev_read = batch.back().read();
+      prev_last_read = last_read_ && evt.id() == *last_read_;
+
+      if(evt.type() == matrix::event::room::Redaction::tag()) {
+        // This will usually be redundant to a call made to redact during normal sync, but redaction is idempotent, and if
+        // a discontinuity arises between the window and the sync batch and is resolved with fetches from /messages then
+        // it would otherwise be missed.
+        try {
+          matrix::event::room::Redaction redaction{evt};
+          redact(redaction);
+        } catch(matrix::malformed_event &e) {
+          qWarning() << "ignoring malformed redaction:" << e.what() << evt.json();
+        }
       }
-    }
-  }
+    });
 
-  const auto id = existing_id ? *existing_id : get_id();
-  const bool prev_read = batches_.empty() ? false : batches_.back().events.back().read;
-  const bool newly_unread = last_read_ && !batches_.empty() && batches_.back().events.back().event && batches_.back().events.back().event->id() == *last_read_;
-  if(!batches_.empty() && batches_.back().begin == begin) {
-    batches_.back().events.emplace_back(id, state, evt);
+  mark_dirty();
+}
+
+void TimelineView::insert(const matrix::TimelineCursor &after, const matrix::TimelineCursor &begin, const matrix::RoomState &state,
+                          gsl::span<const matrix::event::Room> events) {
+  auto it = std::find_if(batches_.begin(), batches_.end(), [&](const Batch &b) { return b.begin == after; });
+  if(it == batches_.end() || events.empty()) return;
+
+  const bool next_read = it->events.front().read();
+  if(it != batches_.begin() && std::prev(it)->begin == begin) {
+    --it;
   } else {
-    batches_.emplace_back(begin, std::deque<EventLike>{EventLike{id, state, evt}});
+    it = batches_.emplace(it, begin, std::deque<EventLike>{});
   }
-  batches_.back().events.back().read = !newly_unread && prev_read;
 
-  if(evt.type() == matrix::event::room::Redaction::tag()) {
-    // This will usually be redundant to a call made to redact during normal sync, but redaction is idempotent, and if a
-    // discontinuity arises between the window and the sync batch and is resolved with fetches from /messages then it
-    // would otherwise be missed.
-    try {
-      matrix::event::room::Redaction redaction{evt};
-      redact(redaction);
-    } catch(matrix::malformed_event &e) {
-      qWarning() << "ignoring malformed redaction:" << e.what() << evt.json();
-    }
-  }
+  with_states(state, events, [&](const matrix::RoomState &s, const matrix::event::Room &evt) {
+      take_pending(evt);
+      it->events.emplace_back(get_id(), interned_, s, evt);
+      it->events.back().set_read(next_read);
+      index(*it, std::prev(it->events.end()), it->events.end());
+    });
 
   mark_dirty();
 }
 
+void TimelineView::set_gap(const matrix::TimelineCursor &after, bool open) {
+  auto it = std::find_if(batches_.begin(), batches_.end(), [&](const Batch &b) { return b.begin == after; });
+  if(it == batches_.end() || it->gap_before == open) return;
+  it->gap_before = open;
+  mark_dirty();
+}
+
+void TimelineView::clear() {
+  batches_.clear();
+  event_index_.clear();
+  interned_.clear();
+  event_bytes_ = 0;
+  budget_.set_usage(this, 0);
+  expanded_runs_.clear();
+  visible_blocks_.clear();
+  tiled_.clear();
+  blocks_.clear();
+  block_index_.clear();
+  extents_.clear();
+  scroll_position_ = {};
+  freeze_selection();
+  selection_ = Selection();
+  selection_updating_ = false;
+  at_bottom_ = false;
+  mark_dirty();
+}
+
+void TimelineView::expand_run(TimelineEventID first) {
+  expanded_runs_.insert(first);
+  mark_dirty();
+}
+
+void TimelineView::scroll_to(const matrix::EventID &event) {
+  scroll_target_ = event;
+  mark_dirty();
+}
+
 void TimelineView::redact(const matrix::event::room::Redaction &redaction) {
-  for(auto &batch : batches_) {
-    for(auto &existing_event : batch.events) {
-      if(existing_event.event->id() == redaction.redacts()) {
-        existing_event.redact(redaction);
-        goto done;
-      }
-    }
+  if(auto existing_event = find_event(redaction.redacts())) {
+    existing_event->redact(redaction);
+    stale_events_.insert(existing_event->id);
   }
-done:
   mark_dirty();
 }
 
 void TimelineView::add_pending(const matrix::TransactionID &transaction, const matrix::RoomState &state, const matrix::UserID &self, Time time,
                                matrix::EventType type, matrix::event::Content content, std::experimental::optional<matrix::UserID> affected_user) {
   pending_.emplace_back(transaction,
-                        EventLike{get_id(), state, self, time, type, content, affected_user});
+                        EventLike{get_id(), interned_, state, self, time, type, content, affected_user});
+  pending_index_[transaction] = std::prev(pending_.end());
   mark_dirty();
 }
 
@@ -1040,18 +1472,25 @@ void TimelineView::set_at_bottom(bool value) {
 
 void TimelineView::set_last_read(const matrix::EventID &id) {
   last_read_ = id;
+  // If it's not loaded, nothing that is would change; otherwise only the unread tail is visited
+  if(!find_event(id)) return;
   bool found = false;
   for(auto batch = batches_.rbegin(); batch != batches_.rend(); ++batch) {
     for(auto event = batch->events.rbegin(); event != batch->events.rend(); ++event) {
-      if(event->read) return;
+      if(event->read()) return;
       if(event->event && event->event->id() == id) {
         found = true;
       }
-      event->read = found;
+      event->set_read(found);
     }
   }
 }
 
+void TimelineView::set_read_markers(std::unordered_map<matrix::EventID, std::size_t> markers) {
+  read_markers_ = std::move(markers);
+  viewport()->update();
+}
+
 optional<matrix::EventID> TimelineView::latest_visible_event() const {
   if(visible_blocks_.empty()) return {};
 
@@ -1086,9 +1525,7 @@ void TimelineView::paintEvent(QPaintEvent *) {
   }
   // TODO: Draw purpose-built pending message block below bottom spinner
 
-  const qreal spacing = block_spacing(*this);
-  const qreal half_spacing = std::round(spacing * 0.5);
-  const qreal padding = block_padding(*this);
+  const qreal half_spacing = std::round(block_spacing(*this) * 0.5);
   const auto view = view_rect();
 
   QPainter painter(viewport());
@@ -1096,63 +1533,190 @@ void TimelineView::paintEvent(QPaintEvent *) {
   painter.setPen(palette().color(QPalette::Text));
   painter.translate(QPointF(0, -view.top())); // Translate into space where y origin is bottom of first block
 
-  bool spinner_present = false;
+  QRegion spinners;
   if(view.bottom() > 0 && !at_bottom_) {
     draw_spinner(painter, 0);
-    spinner_present = true;
+    spinners |= spinner_rect(0);
   }
 
   bool selecting = selection_starts_below_view_;
-  for(const auto &block : visible_blocks_) {
-    painter.save();
+  for(auto &block : visible_blocks_) {
     const auto &bounds = block.bounds();
-    painter.translate(bounds.topLeft());
+    if(block.block().gap_before()) {
+      const qreal top = bounds.top() - half_spacing - spinner_space();
+      draw_spinner(painter, top);
+      spinners |= spinner_rect(top);
+    }
+
+    selecting = draw_block(painter, block, selecting);
+  }
+  draw_read_markers(painter);
 
-    {
-      const auto hash = QCryptographicHash::hash(block.block().sender().value().toUtf8(), QCryptographicHash::Sha3_224);
-      const auto user_color = QColor::fromHsvF(static_cast<uint8_t>(hash[0]) * 1./255., 1, 1);
+  if(!at_top()) {
+    const qreal top = visible_blocks_.empty() ? 0
+      : visible_blocks_.back().bounds().top() - half_spacing - gap_space(visible_blocks_.back().block());
+    if(view.top() < top) {
+      draw_spinner(painter, top - spinner_space());
+      spinners |= spinner_rect(top - spinner_space());
+    }
+  }
 
-      const QRectF outline(-padding, -half_spacing, view.width(), bounds.height() + spacing);
+  if(!spinners.isEmpty()) {
+    // Everything else is unchanged until something says otherwise
+    QTimer::singleShot(30, viewport(), [this, spinners]() { viewport()->update(spinners); });
+  }
+}
 
-      painter.save();
-      painter.setRenderHint(QPainter::Antialiasing);
+bool EventBlock::TileKey::operator==(const TileKey &other) const {
+  return width == other.width && device_pixel_ratio == other.device_pixel_ratio && bottom_selected == other.bottom_selected
+    && focused == other.focused && avatar_ready == other.avatar_ready && mode == other.mode && begin == other.begin
+    && end == other.end;
+}
 
-      QPainterPath path;
-      path.addRoundedRect(outline, padding*2, padding*2);
-      painter.fillPath(path, palette().base());
+bool TimelineView::draw_block(QPainter &painter, VisibleBlock &visible, bool selecting) {
+  auto &block = visible.block();
+  const auto bounds = visible.bounds();
+  const qreal spacing = block_spacing(*this);
+  const qreal half_spacing = std::round(spacing * 0.5);
+  const qreal padding = block_padding(*this);
+  const qreal width = view_rect().width();
 
-      QPainterPath colored;
-      colored.setFillRule(Qt::WindingFill);
-      colored.addRect(QRectF{-padding, -half_spacing, padding, bounds.height() + spacing});
-      painter.fillPath(colored.intersected(path), user_color);
+  EventBlock::TileKey key{width, devicePixelRatioF(), selecting, hasFocus(), block.avatar_ready(), selection_.mode, {}, {}};
+  // Endpoints elsewhere only matter through selecting
+  if(block.has(selection_.begin.event())) key.begin = selection_.begin;
+  if(block.has(selection_.end.event())) key.end = selection_.end;
 
-      QPainterPath separator;
-      separator.addRect(QRectF{0, -half_spacing, view.width(), half_spacing});
-      painter.fillPath(separator.intersected(path), palette().alternateBase());
+  const QRectF outline(-padding, -half_spacing, width, bounds.height() + spacing);
+  auto &tile = block.tile();
+  if(!tile || !(tile->key == key)) {
+    const auto strips = static_cast<std::size_t>(std::ceil(outline.height() / TILE_HEIGHT));
+    tile = EventBlock::Tile{std::move(key), std::vector<QPixmap>(strips), selecting};
+  }
 
-      painter.restore();
+  // Only strips on screen are kept, so a block taller than the view costs no more than the view
+  const auto view = view_rect();
+  const QPointF world_origin = bounds.topLeft() + QPointF(-padding, -half_spacing);
+  for(std::size_t i = 0; i < tile->strips.size(); ++i) {
+    const QRectF strip(outline.left(), outline.top() + i * TILE_HEIGHT,
+                       outline.width(), std::min<qreal>(TILE_HEIGHT, outline.height() - i * TILE_HEIGHT));
+    auto &pixmap = tile->strips[i];
+    if(!strip.translated(world_origin - outline.topLeft()).intersects(view)) {
+      pixmap = QPixmap();
+      continue;
+    }
+    if(pixmap.isNull()) {
+      pixmap = QPixmap(std::ceil(strip.width() * tile->key.device_pixel_ratio),
+                       std::ceil(strip.height() * tile->key.device_pixel_ratio));
+      pixmap.setDevicePixelRatio(tile->key.device_pixel_ratio);
+      pixmap.fill(Qt::transparent);
+      QPainter p(&pixmap);
+      p.setPen(painter.pen());
+      p.translate(-strip.topLeft());
+      p.setClipRect(strip);     // Lets text layouts skip lines outside the strip
+      tile->selecting = draw_tile(p, block, outline, selecting);
     }
+    painter.drawPixmap(world_origin + QPointF(0, i * TILE_HEIGHT), pixmap);
+  }
+  return tile->selecting;
+}
+
+bool TimelineView::draw_tile(QPainter &p, EventBlock &block, const QRectF &outline, bool selecting) {
+  const qreal half_spacing = std::round(block_spacing(*this) * 0.5);
+  const qreal padding = block_padding(*this);
 
-    selecting = block.block().draw(painter, selecting, selection_);
-    painter.restore();
+  {
+    const auto hash = QCryptographicHash::hash(block.sender().value().toUtf8(), QCryptographicHash::Sha3_224);
+    const auto user_color = QColor::fromHsvF(static_cast<uint8_t>(hash[0]) * 1./255., 1, 1);
+
+    p.save();
+    p.setRenderHint(QPainter::Antialiasing);
+
+    QPainterPath path;
+    path.addRoundedRect(outline, padding*2, padding*2);
+    p.fillPath(path, palette().base());
+
+    QPainterPath colored;
+    colored.setFillRule(Qt::WindingFill);
+    colored.addRect(QRectF{outline.left(), outline.top(), padding, outline.height()});
+    p.fillPath(colored.intersected(path), user_color);
+
+    QPainterPath separator;
+    separator.addRect(QRectF{0, -half_spacing, outline.width(), half_spacing});
+    p.fillPath(separator.intersected(path), palette().alternateBase());
+
+    p.restore();
   }
 
-  if(!at_top()) {
-    const qreal top = visible_blocks_.empty() ? 0 : visible_blocks_.back().bounds().top() - half_spacing;
-    if(view.top() < top) {
-      draw_spinner(painter, top - spinner_space());
-      spinner_present = true;
+  return block.draw(p, selecting, selection_);
+}
+
+void TimelineView::draw_read_markers(QPainter &painter) const {
+  // Drawn over the tiles rather than into them, so that receipts moving doesn't cost re-rendering whole blocks
+  if(read_markers_.empty()) return;
+  const QFontMetricsF metrics(font());
+  const qreal padding = block_padding(*this);
+  painter.save();
+  painter.setPen(palette().color(QPalette::Disabled, QPalette::Text));
+  for(const auto &visible : visible_blocks_) {
+    const auto origin = visible.origin();
+    for(const auto &event : visible.block().events()) {
+      if(!event.source) continue;
+      const auto marker = read_markers_.find(event.source->id());
+      if(marker == read_markers_.end()) continue;
+      const auto text = tr("%n read", "", static_cast<int>(marker->second));
+      const auto bounds = event.bounds().translated(origin);
+      const qreal width = metrics.width(text) + padding * 2;
+      const QRectF rect(visible.bounds().right() - width, bounds.bottom() - metrics.height(), width, metrics.height());
+      painter.fillRect(rect, palette().base());
+      painter.drawText(rect, Qt::AlignCenter, text);
     }
   }
+  painter.restore();
+}
 
-  if(spinner_present) {
-    QTimer::singleShot(30, viewport(), static_cast<void (QWidget::*)()>(&QWidget::update));
+void TimelineView::thumbnails_updated() {
+  // Repaint only blocks whose avatar just arrived
+  const auto view = view_rect();
+  const qreal spacing = block_spacing(*this);
+  const qreal padding = block_padding(*this);
+  QRegion dirty;
+  for(auto &visible : visible_blocks_) {
+    auto &block = visible.block();
+    if(!block.tile() || block.tile()->key.avatar_ready != block.avatar_ready()) {
+      dirty |= visible.bounds().translated(0, -view.top()).adjusted(-padding, -spacing, padding, spacing).toAlignedRect();
+    }
   }
+  if(!dirty.isEmpty()) viewport()->update(dirty);
 }
 
-void TimelineView::changeEvent(QEvent *) {
-  // Optimization: Block lifecycle could be refactored to construct/polish/flow instead of construct/flow to reduce CPU use
-  mark_dirty();
+void TimelineView::scrollContentsBy(int dx, int dy) {
+  if(adjusting_scroll_ || blocks_dirty_) {
+    // Content is moving too, so the old image isn't worth reusing
+    viewport()->update();
+    return;
+  }
+  // Only the newly exposed strip gets a paint event, and is drawn from tiles
+  viewport()->scroll(dx, dy);
+}
+
+void TimelineView::changeEvent(QEvent *e) {
+  switch(e->type()) {
+  case QEvent::FontChange:
+  case QEvent::PaletteChange:
+  case QEvent::StyleChange:
+  case QEvent::LanguageChange:
+    // Affects every block
+    // Optimization: Block lifecycle could be refactored to construct/polish/flow instead of construct/flow to reduce CPU use
+    visible_blocks_.clear();
+    tiled_.clear();
+    blocks_.clear();
+    block_index_.clear();
+    extents_.clear();
+    mark_dirty();
+    break;
+  default:
+    break;
+  }
 }
 
 void TimelineView::mousePressEvent(QMouseEvent *event) {
@@ -1170,13 +1734,12 @@ void TimelineView::mousePressEvent(QMouseEvent *event) {
       click_count_ = 0;
     }
     constexpr Selection::Mode selection_modes[] = {Selection::Mode::CHARACTER, Selection::Mode::WORD, Selection::Mode::PARAGRAPH};
+    freeze_selection();
     selection_.mode = selection_modes[std::min<size_t>(2, click_count_)];
     selection_.begin = *get_cursor(world, false);
     selection_.end = selection_.begin;
 
-    QString t = selection_text();
-    if(!t.isEmpty())
-      QGuiApplication::clipboard()->setText(selection_text(), QClipboard::Selection);
+    publish_selection();
 
     viewport()->update();
 
@@ -1220,6 +1783,7 @@ void TimelineView::focusOutEvent(QFocusEvent *e) {
   // Taken from QWidgetTextControl
   if(e->reason() != Qt::ActiveWindowFocusReason
      && e->reason() != Qt::PopupFocusReason) {
+    freeze_selection();
     selection_ = Selection{};
     viewport()->update();
   }
@@ -1244,27 +1808,99 @@ bool TimelineView::viewportEvent(QEvent *e) {
   return QAbstractScrollArea::viewportEvent(e);
 }
 
-QString TimelineView::selection_text() const {
-  QString result;
+// Primary selection contents, extracted only if another application actually asks for them
+class TimelineView::SelectionData : public QMimeData {
+public:
+  SelectionData(TimelineView &view, const Selection &selection) : view_{&view}, selection_{selection} {}
+
+  void set_selection(const Selection &selection) { selection_ = selection; }
+
+  void freeze() {
+    if(frozen_) return;
+    text_ = view_ ? view_->selection_text(selection_) : QString();
+    frozen_ = true;
+  }
+
+  QStringList formats() const override { return QStringList{"text/plain"}; }
+
+protected:
+  QVariant retrieveData(const QString &mime_type, QVariant::Type type) const override {
+    (void)type;
+    if(mime_type != "text/plain") return QVariant();
+    if(frozen_) return text_;
+    return view_ ? view_->selection_text(selection_) : QString();
+  }
+
+private:
+  QPointer<TimelineView> view_;
+  Selection selection_;
+  bool frozen_ = false;
+  QString text_;
+};
 
+QString TimelineView::selection_text(const Selection &selection) const {
+  if(selection.empty() || blocks_.empty()) return QString();
+
+  // Only blocks between the endpoints can contribute
+  std::size_t lowest = 0, highest = blocks_.size() - 1;
+  {
+    auto begin = block_index_.find(selection.begin.event()), end = block_index_.find(selection.end.event());
+    if(begin != block_index_.end() && end != block_index_.end()) {
+      std::tie(lowest, highest) = std::minmax(begin->second, end->second);
+    }
+  }
+
+  // Fragments are produced newest first and joined once at the end, rather than repeatedly prepended
+  std::vector<QString> fragments;
+  int length = 0;
   bool selecting = false;
-  for(auto block = blocks_.rbegin(); block != blocks_.rend(); ++block) {
-    auto r = block->selection_text(selecting, selection_);
+  for(std::size_t i = lowest; i <= highest; ++i) {
+    auto r = blocks_[blocks_.size() - 1 - i]->selection_text(selecting, selection);
     selecting = r.continues;
     if(!r.fragment.isEmpty()) {
-      if(result.isEmpty()) {
-        result = std::move(r.fragment);
-      } else {
-        result = std::move(r.fragment) % "\n" % std::move(result);
-      }
+      length += r.fragment.size() + 1;
+      fragments.push_back(std::move(r.fragment));
     }
   }
 
+  QString result;
+  result.reserve(length);
+  for(auto fragment = fragments.rbegin(); fragment != fragments.rend(); ++fragment) {
+    if(!result.isEmpty()) result += '\n';
+    result += *fragment;
+  }
   return result;
 }
 
+void TimelineView::locate_selection() {
+  const std::size_t first = extents_.find(-view_rect().bottom());
+  auto below_view = [&](TimelineEventID id) {
+    auto it = block_index_.find(id);
+    return it != block_index_.end() && it->second < first;
+  };
+  selection_starts_below_view_ = below_view(selection_.begin.event()) ^ below_view(selection_.end.event());
+}
+
+void TimelineView::publish_selection() {
+  if(selection_.empty()) return;
+  auto clipboard = QGuiApplication::clipboard();
+  if(!clipboard->supportsSelection()) return;
+  if(primary_ && clipboard->ownsSelection() && clipboard->mimeData(QClipboard::Selection) == primary_) {
+    static_cast<SelectionData *>(primary_.data())->set_selection(selection_);
+    return;
+  }
+  auto data = new SelectionData(*this, selection_);
+  primary_ = data;
+  clipboard->setMimeData(data, QClipboard::Selection);  // Takes ownership
+}
+
+void TimelineView::freeze_selection() {
+  if(primary_) static_cast<SelectionData *>(primary_.data())->freeze();
+  primary_ = nullptr;
+}
+
 void TimelineView::copy() const {
-  QString t = selection_text();
+  QString t = selection_text(selection_);
   if(!t.isEmpty()) {
     QGuiApplication::clipboard()->setText(t);
     QGuiApplication::clipboard()->setText(t, QClipboard::Selection);
@@ -1277,6 +1913,8 @@ QRectF TimelineView::view_rect() const {
 }
 
 void TimelineView::update_scrollbar(int content_height) {
+  const bool was_adjusting = adjusting_scroll_;
+  adjusting_scroll_ = true;
   auto &scroll = *verticalScrollBar();
   const bool was_at_bottom = scroll.value() == scroll.maximum();
   const auto view_height = viewport()->contentsRect().height();
@@ -1286,65 +1924,132 @@ void TimelineView::update_scrollbar(int content_height) {
 
   scroll.setMaximum(total_height > view_height ? total_height - view_height : 0);
   scroll.setPageStep(viewport()->contentsRect().height());
+  if(scroll_target_) {
+    // Place the top of the target a third of the way down the view. Until it's loaded, there's nothing to do.
+    const auto target = find_event(*scroll_target_);
+    const auto located = target ? block_index_.find(target->id) : block_index_.end();
+    if(located != block_index_.end()) {
+      scroll_target_ = {};
+      const std::size_t i = located->second;
+      const auto &block = block_at(i);
+      // A target in a collapsed run is represented by the run's summary
+      auto event = block.collapsed() ? block.events().begin()
+        : std::find_if(block.events().begin(), block.events().end(), [&](const EventBlock::Event &e) { return e.id == target->id; });
+      if(event != block.events().end()) {
+        if(ensure_layout(i, true)) {
+          // The target's position is only meaningful once it's laid out, which changes the content height
+          const qreal exact_height = below_content + content_extent() + !at_top() * spinner_space();
+          scroll.setMaximum(exact_height > view_height ? exact_height - view_height : 0);
+        }
+        const qreal block_top = -extents_.prefix(i + 1);
+        const qreal event_top = block_top + gap_space(block) + std::round(block_spacing(*this) * 0.5) + event->bounds().top();
+        scroll.setValue(scroll.maximum() - below_content + event_top + view_height * 2 / 3);
+        adjusting_scroll_ = was_adjusting;
+        return;
+      }
+    }
+  }
   if(was_at_bottom || !scroll_position_) {
     scroll.setValue(scroll.maximum());
   } else {
-    // Find the new position of the top of the lowest previously visible block, then scroll such that the bottom of the
-    // view is below it by the same margin
-    qreal block_top = 0;
-    for(auto block = blocks_.crbegin(); block != blocks_.crend(); ++block) {
-      const auto &bounds = block->bounds();
-      const auto block_height = std::round(block_spacing(*this) + bounds.height());
-      block_top -= block_height;
-      if(block->events().front().id == scroll_position_->block) {
-        scroll.setValue(scroll.maximum() - below_content + (block_top + block_height + scroll_position_->from_bottom));
-        break;
-      }
+    // Find the new position of the bottom of the lowest previously visible block, then scroll such that the bottom of
+    // the view is below it by the same margin
+    auto block = block_index_.find(scroll_position_->block);
+    if(block != block_index_.end()) {
+      const qreal block_bottom = -extents_.prefix(block->second);
+      scroll.setValue(scroll.maximum() - below_content + (block_bottom + scroll_position_->from_bottom));
     }
   }
+  adjusting_scroll_ = was_adjusting;
 }
 
 // Whether two events should be assigned to distinct blocks
 static bool block_border(const EventLike &a, const EventLike &b) {
-  return b.sender != a.sender || !b.time || !a.time || *b.time - *a.time > BLOCK_MERGE_INTERVAL;
+  return b.sender() != a.sender() || !b.time() || !a.time() || *b.time() - *a.time() > BLOCK_MERGE_INTERVAL;
 }
 
 void TimelineView::rebuild_blocks() {
   // TODO: Separate block for pending messages if there's a bottom spinner
-  std::deque<EventBlock> new_blocks;
+
+  // Blocks built from exactly the same events as before are reused along with their layout, so that e.g. a new message
+  // only costs constructing the last block, and a redaction only the block containing it.
+  std::unordered_map<TimelineEventID, std::unique_ptr<EventBlock>> old_blocks;
+  old_blocks.reserve(blocks_.size());
+  for(auto &block : blocks_) {
+    const auto first = block->first_source();
+    old_blocks.emplace(first, std::move(block));
+  }
+  visible_blocks_.clear();
+  blocks_.clear();
+
   std::vector<const EventLike *> block_events;
+  std::vector<std::pair<TimelineEventID, std::size_t>> sources; // Each source event and its block, from the oldest
+  bool gap = false;             // Whether the block being accumulated follows a gap
+  auto flush = [&](bool collapsed) {
+    std::unique_ptr<EventBlock> block;
+    auto it = old_blocks.find(block_events.front()->id);
+    if(it != old_blocks.end() && it->second->source_count() == block_events.size() && it->second->collapsed() == collapsed
+       && std::none_of(block_events.begin(), block_events.end(), [&](const EventLike *e) { return stale_events_.count(e->id); })) {
+      block = std::move(it->second);
+    } else {
+      block = std::make_unique<EventBlock>(*this, thumbnail_cache_, block_events, collapsed);
+    }
+    block->set_gap_before(gap);
+    // A block can be empty if it consisted entirely of malformed events.
+    if(!block->events().empty()) {
+      for(const auto event : block_events) sources.emplace_back(event->id, blocks_.size());
+      blocks_.emplace_back(std::move(block));
+    }
+    gap = false;
+    block_events.clear();
+  };
   for(const auto &batch : batches_) {
-    for(const auto &event : batch.events) {
-      if(!block_events.empty() && block_border(*block_events.back(), event)) {
-        new_blocks.emplace_back(*this, thumbnail_cache_, block_events);
-        block_events.clear();
+    if(batch.gap_before) {
+      if(!block_events.empty()) flush(false);
+      gap = true;
+    }
+    for(auto event = batch.events.begin(); event != batch.events.end();) {
+      // Long runs of membership changes, as seen in busy public rooms, are summarized unless the user asked otherwise
+      const auto run_end = std::find_if_not(event, batch.events.end(), is_membership);
+      if(static_cast<std::size_t>(run_end - event) >= COLLAPSE_RUN_LENGTH && !expanded_runs_.count(event->id)) {
+        if(!block_events.empty()) flush(false);
+        for(; event != run_end; ++event) block_events.emplace_back(&*event);
+        flush(true);
+        continue;
+      }
+      for(const auto end = run_end == event ? std::next(event) : run_end; event != end; ++event) {
+        if(!block_events.empty() && block_border(*block_events.back(), *event)) {
+          flush(false);
+        }
+        block_events.emplace_back(&*event);
       }
-      block_events.emplace_back(&event);
     }
   }
   if(at_bottom_) {
     for(const auto &event : pending_) {
       if(!block_events.empty() && block_border(*block_events.back(), event.event)) {
-        new_blocks.emplace_back(*this, thumbnail_cache_, block_events);
-        block_events.clear();
-        if(new_blocks.back().events().empty()) {
-          // This can happen if the block consisted entirely of malformed events.
-          new_blocks.pop_back();
-        }
+        flush(false);
       }
       block_events.emplace_back(&event.event);
     }
   }
   if(!block_events.empty()) {
-    new_blocks.emplace_back(*this, thumbnail_cache_, block_events);
-    if(new_blocks.back().events().empty()) {
-      // This can happen if the block consisted entirely of malformed events.
-      new_blocks.pop_back();
-    }
-    block_events.clear();
+    flush(false);
+  }
+  stale_events_.clear();
+
+  // Covers events hidden in collapsed runs as well, so that e.g. a scroll target among them can be found
+  block_index_.clear();
+  block_index_.reserve(sources.size());
+  for(const auto &source : sources) {
+    block_index_.emplace(source.first, blocks_.size() - 1 - source.second);
+  }
+  {
+    // Forget tiled blocks that weren't reused
+    std::unordered_set<const EventBlock *> live;
+    for(const auto &block : blocks_) live.insert(block.get());
+    tiled_.erase(std::remove_if(tiled_.begin(), tiled_.end(), [&](const EventBlock *b) { return !live.count(b); }), tiled_.end());
   }
-  visible_blocks_.clear();
-  std::swap(blocks_, new_blocks);
   update_layout();
   blocks_dirty_ = false;
 }
@@ -1352,24 +2057,232 @@ void TimelineView::rebuild_blocks() {
 void TimelineView::update_layout() {
   ensurePolished();
 
-  qreal content_height = blocks_.size() * block_spacing(*this);
+  // Only blocks in view are laid out immediately, by compute_visible_blocks; the rest are estimated until refine_layout
+  // gets to them.
+  reindex_extents();
+  update_scrollbar(content_extent());
+  compute_visible_blocks();
+  viewport()->update();
+  if(!layout_timer_.isActive()) layout_timer_.start();
+}
 
-  const auto width = viewport()->contentsRect().width() - 2*block_padding(*this);
-  for(auto &block : blocks_) {
-    block.update_layout(width);
-    content_height += block.bounds().height();
+TimelineView::~TimelineView() {
+  budget_.release(this);
+  freeze_selection();           // The clipboard may outlive us
+  // Workers refer to this object
+  shaper_pool_.clear();
+  shaper_pool_.waitForDone();
+}
+
+qreal TimelineView::layout_width() const {
+  return viewport()->contentsRect().width() - 2*block_padding(*this);
+}
+
+qreal TimelineView::block_height(const EventBlock &block) const {
+  const auto width = layout_width();
+  // A stale layout is a better estimate than counting characters, and is what will be drawn until replaced
+  return block.has_layout() ? block.bounds().height() : block.estimate_height(width);
+}
+
+qreal TimelineView::block_extent(const EventBlock &block) const {
+  return std::round(block_spacing(*this) + block_height(block)) + gap_space(block);
+}
+
+qreal TimelineView::content_extent() const {
+  return extents_.total();
+}
+
+EventBlock &TimelineView::block_at(std::size_t i) {
+  return *blocks_[blocks_.size() - 1 - i];
+}
+
+void TimelineView::reindex_extents() {
+  std::vector<qreal> extents;
+  extents.reserve(blocks_.size());
+  for(auto block = blocks_.crbegin(); block != blocks_.crend(); ++block) {
+    extents.push_back(block_extent(**block));
   }
+  extents_.assign(std::move(extents));
+}
 
-  update_scrollbar(content_height);
+bool TimelineView::sync_extent(std::size_t i) {
+  const auto extent = block_extent(block_at(i));
+  if(extent == extents_[i]) return false;
+  extents_.set(i, extent);
+  return true;
+}
+
+bool TimelineView::ensure_layout(std::size_t i, bool wait) {
+  auto &block = block_at(i);
+  const auto width = layout_width();
+  if(block.laid_out_at(width)) return false;
+  if(!wait && block.text_size() > BACKGROUND_LAYOUT_CHARS && !block.layout_cached(width)) {
+    block.request_layout(shaper_pool_, width);
+    return false;
+  }
+  block.update_layout(width);
+  return sync_extent(i);
+}
+
+void TimelineView::refine_layout() {
+  if(verticalScrollBar()->isSliderDown()) {
+    // Don't move content out from under a dragged scroll bar
+    layout_timer_.start(100);
+    return;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  const auto width = layout_width();
+  bool changed = false, remaining = false;
+  // Nearest the present first, since that's where scrolling most often leads
+  for(std::size_t i = 0; i < blocks_.size(); ++i) {
+    if(block_at(i).laid_out_at(width)) continue;
+    if(timer.elapsed() >= LAYOUT_BUDGET_MS) {
+      remaining = true;
+      break;
+    }
+    changed |= ensure_layout(i);
+  }
+
+  if(changed) {
+    // Keeps the content in view still, per scroll_position_
+    update_scrollbar(content_extent());
+    compute_visible_blocks();
+    viewport()->update();
+  }
+  if(remaining) layout_timer_.start(0);
+}
+
+void TimelineView::collect_shaped() {
+  bool changed = false;
+  for(std::size_t i = 0; i < blocks_.size(); ++i) {
+    if(block_at(i).adopt_layout()) changed |= sync_extent(i);
+  }
+  if(!changed) {
+    viewport()->update();       // Still needs drawing
+    return;
+  }
+
+  update_scrollbar(content_extent());
   compute_visible_blocks();
   viewport()->update();
 }
 
 void TimelineView::maybe_need_forwards() {
+  if(at_bottom_) return;
   const auto view = view_rect();
-  if(!at_bottom_ && -view.bottom() < view.height()) {
-    need_forwards();
+  const qreal below = -view.bottom();
+  const qreal wanted = prefetch_distance(scroll_velocity_);
+  if(below < wanted) {
+    need_forwards(prefetch_events(wanted - below));
+  } else if(-scroll_velocity_ > REVERSAL_SPEED && below >= prefetch_distance(0)) {
+    prefetch_cancelled(matrix::Direction::FORWARD);
+  }
+}
+
+void TimelineView::track_scroll(int value) {
+  using namespace std::chrono;
+  const auto now = steady_clock::now();
+  const qreal dt = duration<qreal>(now - last_scroll_time_).count();
+  const int dy = value - last_scroll_value_;
+  last_scroll_value_ = value;
+  last_scroll_time_ = now;
+  if(adjusting_scroll_ || dt <= 0) return;
+
+  // Exponential moving average, so that a long pause decays the velocity to nearly nothing
+  const qreal alpha = std::min<qreal>(1, dt / VELOCITY_SMOOTHING);
+  scroll_velocity_ += alpha * (dy / dt - scroll_velocity_);
+}
+
+std::size_t TimelineView::memory_usage() const {
+  std::size_t bytes = event_bytes_ + line_cache_.size();
+  for(const auto block : tiled_) {
+    if(const auto &tile = block->tile()) {
+      for(const auto &strip : tile->strips) {
+        bytes += static_cast<std::size_t>(strip.width()) * strip.height() * strip.depth() / 8;
+      }
+    }
+  }
+  return bytes;
+}
+
+void TimelineView::enforce_budget() {
+  std::size_t usage = memory_usage();
+  budget_.set_usage(this, usage);
+  // As with discarding by distance, a selection could be invalidated
+  if(!selection_.empty() || batches_.size() < 2) return;
+
+  const std::size_t others = budget_.total() - usage;
+  auto over = [&]() { return usage > budget_.consumer_limit() || others + usage > budget_.total_limit(); };
+  if(!over()) return;
+
+  // Locate the view among the batches through the event at its bottom. Without a scroll position, or if that is a
+  // pending event, the view is at the bottom.
+  std::size_t anchor = batches_.size() - 1;
+  if(scroll_position_) {
+    const auto block = block_index_.find(scroll_position_->block);
+    if(block != block_index_.end()) {
+      const auto &source = block_at(block->second).events().front().source;
+      const auto indexed = source ? event_index_.find(source->id()) : event_index_.end();
+      if(indexed != event_index_.end()) {
+        auto batch = std::find_if(batches_.begin(), batches_.end(),
+                                  [&](const Batch &b) { return b.begin == indexed->second.batch; });
+        if(batch != batches_.end()) anchor = batch - batches_.begin();
+      }
+    }
+  }
+
+  // Batches within prefetch distance of the view are kept regardless, since they'd only be fetched again immediately
+  const std::size_t keep = prefetch_events(prefetch_distance(std::abs(scroll_velocity_)));
+  std::size_t first = 0, last = batches_.size() - 1; // Retained
+  std::size_t above = 0, below = 0; // Events strictly between the first or last retained batch and the anchor
+  for(std::size_t i = first + 1; i < anchor; ++i) above += batches_[i].events.size();
+  for(std::size_t i = anchor + 1; i < last; ++i) below += batches_[i].events.size();
+  while(over()) {
+    const bool can_above = first < anchor && above >= keep;
+    const bool can_below = last > anchor && below >= keep;
+    if(!can_above && !can_below) break;
+    if(can_above && (!can_below || above >= below)) {
+      usage -= batches_[first].bytes;
+      ++first;
+      above -= batches_[first].events.size();
+    } else {
+      usage -= batches_[last].bytes;
+      --last;
+      below -= batches_[last].events.size();
+    }
+  }
+
+  if(last + 1 < batches_.size()) {
+    discarded_after(batches_[last].begin);
+    std::for_each(batches_.begin() + last + 1, batches_.end(), [this](const Batch &b) { unindex(b); });
+    batches_.erase(batches_.begin() + last + 1, batches_.end());
+    at_bottom_ = false;
+    mark_dirty();
+  }
+  if(first > 0) {
+    discarded_before(batches_[first].begin);
+    std::for_each(batches_.begin(), batches_.begin() + first, [this](const Batch &b) { unindex(b); });
+    batches_.erase(batches_.begin(), batches_.begin() + first);
+    batches_.front().gap_before = false;
+    mark_dirty();
   }
+  budget_.set_usage(this, memory_usage());
+}
+
+qreal TimelineView::prefetch_distance(qreal speed) const {
+  return viewport()->contentsRect().height() * PREFETCH_PAGES + std::max<qreal>(0, speed) * PREFETCH_HORIZON;
+}
+
+qreal TimelineView::discard_distance(qreal speed) const {
+  // Always beyond prefetch_distance, lest freshly fetched content be thrown away immediately
+  return viewport()->contentsRect().height() * DISCARD_PAGES_AWAY + std::max<qreal>(0, speed) * PREFETCH_HORIZON;
+}
+
+std::size_t TimelineView::prefetch_events(qreal distance) const {
+  const qreal height = event_height_estimate_ > 0 ? event_height_estimate_ : 2 * fontMetrics().lineSpacing();
+  return std::max<std::size_t>(1, std::ceil(distance / height));
 }
 
 bool TimelineView::at_top() const {
@@ -1380,6 +2293,17 @@ qreal TimelineView::spinner_space() const {
   return fontMetrics().lineSpacing() * 4;
 }
 
+qreal TimelineView::gap_space(const EventBlock &block) const {
+  return block.gap_before() ? spinner_space() : 0;
+}
+
+QRect TimelineView::spinner_rect(qreal top) const {
+  // Large enough to contain the pixmap at any rotation
+  const qreal extent = std::ceil(std::sqrt(2.) * spinner_.width() / spinner_.devicePixelRatio()) + 2;
+  const QPointF center(view_rect().width() * 0.5, top + spinner_space() * 0.5 - view_rect().top());
+  return QRectF(center - QPointF(extent * 0.5, extent * 0.5), QSizeF(extent, extent)).toAlignedRect();
+}
+
 void TimelineView::draw_spinner(QPainter &painter, qreal top) const {
   const qreal extent = spinner_.width() / spinner_.devicePixelRatio();
   painter.save();
@@ -1408,6 +2332,20 @@ void TimelineView::dispatch_input(const QPointF &world, QEvent *input) {
 
 TimelineEventID TimelineView::get_id() { return TimelineEventID{id_counter_++}; }
 
+optional<TimelineEventID> TimelineView::take_pending(const matrix::event::Room &evt) {
+  if(pending_.empty()) return {};
+  auto u = evt.unsigned_data();
+  if(!u) return {};
+  auto txid = u->transaction_id();
+  if(!txid) return {};
+  auto it = pending_index_.find(*txid);
+  if(it == pending_index_.end()) return {};
+  const auto id = it->second->event.id;
+  pending_.erase(it->second);
+  pending_index_.erase(it);
+  return id;
+}
+
 QRectF TimelineView::VisibleBlock::bounds() const {
   return block_.bounds().translated(origin_);
 }
@@ -1433,88 +2371,141 @@ void TimelineView::compute_visible_blocks() {
   const qreal padding = block_padding(*this);
   const auto view = view_rect();
 
+  const auto previously_visible = std::move(tiled_);
+  tiled_.clear();
   visible_blocks_.clear();
   selection_starts_below_view_ = false;
 
   if(batches_.empty()) return;
 
-  qreal offset = 0;
-  std::deque<EventBlock>::reverse_iterator block;
-  optional<matrix::EventID> latest_retained_event;
-  for(block = blocks_.rbegin(); block != blocks_.rend(); ++block) {
-    const auto &bounds = block->bounds();
-    const auto total_height = std::round(spacing + bounds.height());
+  // Block i counting from the newest spans [-prefix(i+1), -prefix(i)] of extents_, in the space where y = 0 is the bottom
+  // of the newest block
+  const std::size_t n = blocks_.size();
+  const std::size_t first = extents_.find(-view.bottom());
+  auto block_top = [&](std::size_t i) { return -extents_.prefix(i + 1); };
 
-    offset -= total_height;
+  locate_selection();
 
-    if(offset > view.bottom()) {
-      selection_starts_below_view_ ^= block->has(selection_.begin.event()) ^ block->has(selection_.end.event());
+  bool refined = false, reached_top = true;
+  std::size_t topmost = first;  // Highest block in view
+  for(std::size_t i = first; i < n; ++i) {
+    auto &block = block_at(i);
+    refined |= ensure_layout(i);  // Everything in view is laid out exactly
+    const qreal top = block_top(i);
 
-      for(auto event = block->events().crbegin(); event != block->events().crend(); ++event) {
-        const qreal event_top = event->bounds().top() + offset;
-        if(event_top - view.bottom() < DISCARD_PAGES_AWAY * view.height()) {
-          break;
-        }
-        if(event->source) latest_retained_event = event->source->id();
-      }
-
-      continue;
+    if(i == first) {
+      scroll_position_ = ScrollPosition{block.events().front().id, view.bottom() - (top + extents_[i])};
+    }
+    if(block.has_layout()) {
+      // Otherwise left blank until its background layout is ready
+      visible_blocks_.emplace_back(block, QPointF(padding, top + gap_space(block) + half_spacing));
+      tiled_.push_back(&block);
     }
 
-    if(visible_blocks_.empty()) {
-      scroll_position_ = ScrollPosition{block->events().front().id, view.bottom() - (offset + total_height)};
+    topmost = i;
+    if(top < view.top()) {
+      reached_top = false;
+      break;
     }
-    visible_blocks_.emplace_back(*block, QPointF(padding, offset + half_spacing));
+  }
 
-    if(offset < view.top()) break;
+  for(auto block : previously_visible) {
+    // Tiles are only kept for blocks in view
+    if(std::find(tiled_.begin(), tiled_.end(), block) == tiled_.end()) block->tile() = {};
   }
 
-  optional<matrix::EventID> earliest_retained_event;
-  // Compute vertical extent of all blocks and back discard_before off until it's outside DISCARD_PAGES_AWAY
-  for(; block != blocks_.rend(); ++block) {
-    offset -= std::round(spacing + block->bounds().height());
+  if(refined) {
+    // Exact heights replaced estimates, so reposition the view on scroll_position_ and start over
+    update_scrollbar(content_extent());
+    compute_visible_blocks();
+    viewport()->update();
+    return;
+  }
 
-    for(auto event = block->events().crbegin(); event != block->events().crend(); ++event) {
-      const qreal event_bottom = event->bounds().bottom() + offset;
-      if(view.top() - event_bottom > DISCARD_PAGES_AWAY * view.height()) {
-        break;
+  // Find the nearest events to the view beyond which batches can be discarded. Positions are monotonic, so only the
+  // blocks containing each boundary and their neighbors need be examined.
+  optional<matrix::EventID> latest_retained_event;
+  const qreal boundary = view.bottom() + discard_distance(scroll_velocity_);
+  if(first > 0 && boundary <= 0) {
+    // Highest event whose top is at least discard_distance below the view
+    for(std::size_t i = std::min(extents_.find(-boundary), first - 1) + 1; i-- > 0 && !latest_retained_event;) {
+      const auto &block = block_at(i);
+      const bool exact = block.has_layout();
+      for(const auto &event : block.events()) {
+        const qreal event_top = (exact ? event.bounds().top() : 0) + block_top(i) + gap_space(block);
+        if(event_top >= boundary && event.source) {
+          latest_retained_event = event.source->id();
+          break;
+        }
       }
-      if(event->source) earliest_retained_event = event->source->id();
     }
   }
 
-  if(selection_text().isEmpty()) { // Don't discard blocks while there's a selection, lest we invalidate it. TODO: Be less conservative.
+  optional<matrix::EventID> earliest_retained_event;
+  if(!reached_top) {
+    // Highest event whose bottom is within discard_distance above the view
+    const qreal upper_boundary = view.top() - discard_distance(-scroll_velocity_);
+    const std::size_t containing = extents_.find(-upper_boundary);
+    if(containing < n) {
+      for(std::size_t i = containing + 1; i-- > topmost && !earliest_retained_event;) {
+        const auto &block = block_at(i);
+        const bool exact = block.has_layout();
+        for(const auto &event : block.events()) {
+          const qreal event_bottom = (exact ? event.bounds().bottom() : block_height(block)) + block_top(i) + gap_space(block);
+          if(event_bottom >= upper_boundary && event.source) {
+            earliest_retained_event = event.source->id();
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  if(selection_.empty()) { // Don't discard blocks while there's a selection, lest we invalidate it. TODO: Be less conservative.
     std::deque<Batch>::iterator discard_before, discard_after;
     // This search can fail if compute_visible_blocks has already been called since the last time the block list was rebuilt
     bool earliest_found = false, latest_found = false;
-    for(auto it = batches_.begin(); it != batches_.end(); ++it) {
-      if(earliest_retained_event && it->contains(*earliest_retained_event)) {
-        earliest_found = true;
-        discard_before = it;
-      }
-      if(latest_retained_event && it->contains(*latest_retained_event)) {
-        latest_found = true;
-        discard_after = it;
-      }
+    if(earliest_retained_event) {
+      discard_before = batch_of(*earliest_retained_event);
+      earliest_found = discard_before != batches_.end();
+    }
+    if(latest_retained_event) {
+      discard_after = batch_of(*latest_retained_event);
+      latest_found = discard_after != batches_.end();
     }
 
     if(latest_found && batches_.end() - discard_after > 1) {
       auto first_erased = discard_after+1;
       discarded_after(discard_after->begin);
+      std::for_each(first_erased, batches_.end(), [this](const Batch &b) { unindex(b); });
       batches_.erase(first_erased, batches_.end());
       at_bottom_ = false;
       mark_dirty();
     }
     if(earliest_found && discard_before != batches_.begin()) {
       discarded_before(discard_before->begin);
+      std::for_each(batches_.begin(), discard_before, [this](const Batch &b) { unindex(b); });
       batches_.erase(batches_.begin(), discard_before);
+      batches_.front().gap_before = false; // Nothing to be missing between any more
       mark_dirty();
     }
   }
 
+  enforce_budget();
+
+  {
+    std::size_t events = 0;
+    for(const auto &b : batches_) events += b.events.size();
+    if(events != 0) event_height_estimate_ = content_extent() / events;
+  }
+
   maybe_need_forwards();
-  if(view.top() - offset < view.height()) {
-    need_backwards();
+  const qreal above = view.top() + content_extent();
+  const qreal wanted = prefetch_distance(-scroll_velocity_);
+  if(above < wanted) {
+    need_backwards(prefetch_events(wanted - above));
+  } else if(scroll_velocity_ > REVERSAL_SPEED && above >= prefetch_distance(0)) {
+    prefetch_cancelled(matrix::Direction::BACKWARD);
   }
 }
 
@@ -1525,11 +2516,8 @@ void TimelineView::selection_dragged(const QPointF &world) {
     viewport()->update();
   }
 
-  QString t = selection_text();
-  if(!t.isEmpty())
-    QGuiApplication::clipboard()->setText(selection_text(), QClipboard::Selection);
-
-  compute_visible_blocks();     // Ensure selection_starts_below_view_ is accurate
+  publish_selection();
+  locate_selection();
 }
 
 void TimelineView::mark_dirty() {
@@ -1541,19 +2529,42 @@ void TimelineView::mark_read() {
   auto id = latest_visible_event();
   if(!id) return;
 
-  // Optimization: index stored events by ID for logarithmic or constant time read check
-  for(auto batch = batches_.rbegin(); batch != batches_.rend(); ++batch) {
-    for(auto event = batch->events.rbegin(); event != batch->events.rend(); ++event) {
-      if(event->read) return;
-      if(event->event && event->event->id() == *id) {
-        event_read(*id);
-        set_last_read(*id);
-        return;
-      }
-    }
+  // Everything before a read event is read too, so this is the same as checking for a read event after it
+  const auto event = find_event(*id);
+  if(!event || event->read()) return;
+  event_read(*id);
+  set_last_read(*id);
+}
+
+void TimelineView::index(Batch &batch, std::deque<EventLike>::iterator begin, std::deque<EventLike>::iterator end) {
+  for(auto it = begin; it != end; ++it) {
+    if(it->event) event_index_[it->event->id()] = Indexed{&*it, batch.begin};
+    const auto bytes = footprint(*it);
+    batch.bytes += bytes;
+    event_bytes_ += bytes;
+  }
+  budget_.set_usage(this, memory_usage());
+}
+
+void TimelineView::unindex(const Batch &batch) {
+  event_bytes_ -= batch.bytes;
+  for(const auto &event : batch.events) {
+    if(!event.event) continue;
+    auto it = event_index_.find(event.event->id());
+    // A duplicate elsewhere may have taken over the entry
+    if(it != event_index_.end() && it->second.event == &event) event_index_.erase(it);
   }
 }
 
-bool TimelineView::Batch::contains(const matrix::EventID &id) const {
-  return events.end() != std::find_if(events.begin(), events.end(), [&](const EventLike &e) { return e.event && e.event->id() == id; });
+EventLike *TimelineView::find_event(const matrix::EventID &id) {
+  auto it = event_index_.find(id);
+  return it == event_index_.end() ? nullptr : it->second.event;
+}
+
+std::deque<TimelineView::Batch>::iterator TimelineView::batch_of(const matrix::EventID &id) {
+  auto it = event_index_.find(id);
+  if(it == event_index_.end()) return batches_.end();
+  // Batches are few, and their positions shift as they're added and discarded, so they're found by cursor
+  const auto &cursor = it->second.batch;
+  return std::find_if(batches_.begin(), batches_.end(), [&](const Batch &b) { return b.begin == cursor; });
 }
@@ -2,22 +2,35 @@
 #define NATIVE_CHAT_TIMELINE_VIEW_HPP_
 
 #include <deque>
+#include <list>
+#include <memory>
+#include <unordered_set>
+#include <unordered_map>
 #include <experimental/optional>
 #include <chrono>
+#include <cstdint>
 
 #include <QAbstractScrollArea>
+#include <QTimer>
+#include <QThreadPool>
 #include <QTextLayout>
 #include <QPixmap>
+#include <QPointer>
+#include <QMimeData>
 
 #include <span.h>
 
 #include "matrix/Event.hpp"
 
 #include "ContentCache.hpp"
+#include "LineCache.hpp"
 #include "FixedVector.hpp"
+#include "FenwickTree.hpp"
+#include "linkify.hpp"
 
 class QEvent;
 class QShortcut;
+class MemoryBudget;
 
 namespace matrix {
 class RoomState;
@@ -27,41 +40,93 @@ using Time = std::chrono::time_point<std::chrono::system_clock, std::chrono::mil
 
 class TimelineEventID : public matrix::ID<uint64_t> { using ID::ID; };
 
-struct EventLike {
-  struct MemberInfo {
-    matrix::UserID user;
-    matrix::event::room::MemberContent prev_content;
+namespace std {
+
+template<>
+struct hash<TimelineEventID> {
+  size_t operator()(const TimelineEventID &id) const {
+    return std::hash<uint64_t>()(id.value());
+  }
+};
+
+}
+
+// An event's display text, split into paragraphs, with the spans that link somewhere. Independent of font and palette
+// so that it can be kept with the event rather than recomputed whenever a block containing it is rebuilt.
+struct EventText {
+  struct Paragraph {
+    QString text;
+    std::vector<Link> links;    // Relative to the paragraph; may extend past either end
   };
 
-  TimelineEventID id;
-  std::experimental::optional<matrix::event::Room> event;
-  matrix::EventType type;
-  std::experimental::optional<Time> time;
-  matrix::UserID sender;
+  std::vector<Paragraph> paragraphs;
+  std::experimental::optional<QString> name; // Sender name embedded in the text, if any
+};
+
+// A user's membership as of some point in the timeline, shared by every event that saw the same one
+struct Profile {
+  matrix::UserID user;
+  std::experimental::optional<matrix::event::room::MemberContent> member; // Set iff the user was a member
   std::experimental::optional<QString> disambiguation;
+};
 
-  std::experimental::optional<matrix::event::room::MemberContent> member_content;
-  // Set to sender's info iff sender is a member of the room
+// Hands out shared profiles and event types, so that events seen under unchanged state don't each hold copies
+class InternTable {
+public:
+  std::shared_ptr<const Profile> profile(const matrix::RoomState &state, const matrix::UserID &user);
+  matrix::EventType type(const matrix::EventType &type);
 
-  std::experimental::optional<MemberInfo> affected_user_info;
-  // Set to information about the affected user iff type == Member::tag()
+  void clear() { profiles_.clear(); types_.clear(); }
 
-  std::experimental::optional<matrix::EventID> redacts;
-  // Set to the redacted event iff type == Redaction::tag()
+private:
+  std::unordered_map<matrix::UserID, std::shared_ptr<const Profile>> profiles_; // Latest handed out for each user
+  std::unordered_set<matrix::EventType> types_;
+};
 
-  matrix::event::Content content;
+struct EventLike {
+  TimelineEventID id;
+  std::experimental::optional<matrix::event::Room> event;
+  // Shares its JSON with the window it came from. Absent for local echoes.
+  matrix::EventType type;       // Interned
 
-  bool read;
+  mutable std::shared_ptr<const EventText> text;
+  // Computed when first displayed and discarded on redaction
 
-  explicit EventLike(TimelineEventID id, const matrix::RoomState &, matrix::event::Room real);
-  EventLike(TimelineEventID id, const matrix::RoomState &,
+  EventLike(TimelineEventID id, InternTable &, const matrix::RoomState &, matrix::event::Room real);
+  EventLike(TimelineEventID id, InternTable &, const matrix::RoomState &,
             const matrix::UserID &sender, Time time, matrix::EventType type, matrix::event::Content content,
-            std::experimental::optional<matrix::UserID> affected_user = {}, std::experimental::optional<matrix::EventID> redacts = {});
+            std::experimental::optional<matrix::UserID> affected_user = {});
+
+  const matrix::UserID &sender() const { return sender_->user; }
+  const std::experimental::optional<matrix::event::room::MemberContent> &member_content() const { return sender_->member; }
+  // Set to sender's info iff sender is a member of the room
+  const std::experimental::optional<QString> &disambiguation() const { return sender_->disambiguation; }
+
+  const Profile *affected_user() const { return affected_.get(); }
+  // The affected user's profile before the event iff type == Member::tag()
+
+  std::experimental::optional<Time> time() const;
+  matrix::event::Content content() const { return event ? event->content() : matrix::event::Content{local_content_}; }
+  std::experimental::optional<matrix::EventID> redacts() const; // Set iff type == Redaction::tag()
+
+  bool read() const { return flags_ & READ; }
+  void set_read(bool value) { flags_ = value ? (flags_ | READ) : (flags_ & ~READ); }
 
   std::experimental::optional<matrix::event::room::MemberContent> effective_profile() const;
   void redact(const matrix::event::room::Redaction &);
 
   std::experimental::optional<matrix::event::room::Redaction> redaction() const;
+
+private:
+  enum Flags : uint8_t {
+    READ = 1 << 0,
+    TIMED = 1 << 1,             // time_ is meaningful
+  };
+
+  std::shared_ptr<const Profile> sender_, affected_;
+  QJsonObject local_content_;   // Only for local echoes; real events' content is found in event
+  Time time_;
+  uint8_t flags_;
 };
 
 class Cursor {
@@ -103,6 +168,9 @@ struct Selection {
   Cursor end;
 
   Selection() : mode{Mode::CHARACTER}, begin{TimelineEventID{0}, 0, 0}, end{begin} {}
+
+  bool empty() const { return mode == Mode::CHARACTER && begin == end; }
+  // Conservative: selecting by word or paragraph at a single point is non-empty even if it happens to cover no text
 };
 
 class TimelineView;
@@ -123,13 +191,28 @@ public:
     FixedVector<QTextLayout> paragraphs;
 
     Event(const TimelineView &, const EventBlock &, const EventLike &);
+    Event(const TimelineView &, const EventLike &first, const EventLike &last, const QString &summary);
+    // Stands in for a collapsed run, identified by its first event and carrying its last as the source
 
     QRectF bounds() const;
   };
 
-  EventBlock(TimelineView &parent, ThumbnailCache &cache, gsl::span<const EventLike *const> events); // All events should have same sender
+  EventBlock(TimelineView &parent, ThumbnailCache &cache, gsl::span<const EventLike *const> events, bool collapsed = false);
+  // All events should have same sender unless collapsed, in which case they should all be membership changes
+
+  bool collapsed() const { return collapsed_; }
+  // Whether the block is a single summary line for a run of membership changes, expanded into their own blocks on click
 
   void update_layout(qreal width);
+  void request_layout(QThreadPool &pool, qreal width);
+  // Like update_layout, but shapes the text on pool, keeping the current layout until adopt_layout
+  bool adopt_layout(); // Swap in a finished background layout; returns true iff there was one
+  bool layout_cached(qreal width); // Whether update_layout(width) can reuse known line breaks throughout
+  bool laid_out_at(qreal width) const { return layout_width_ == width; }
+  bool has_layout() const { return layout_width_ >= 0; } // Possibly at a stale width
+  std::size_t text_size() const { return text_size_; }
+  qreal estimate_height(qreal width) const;
+  // Cheap approximation of bounds().height() after update_layout(width), for blocks not yet laid out
 
   QRectF bounds() const;
   bool draw(QPainter &painter, bool bottom_selected, const Selection &selection) const; // returns true iff selection began but did not end
@@ -152,11 +235,44 @@ public:
 
   const FixedVector<Event> &events() const { return events_; }
 
+  TimelineEventID first_source() const { return first_source_; }
+  std::size_t source_count() const { return source_count_; }
+  // Identify the events this block was built from, including any that were malformed and so omitted from events()
+
+  bool gap_before() const { return gap_before_; }
+  void set_gap_before(bool value) { gap_before_ = value; }
+  // Whether events are missing immediately before this block
+
+  bool avatar_ready() const { return avatar_ && static_cast<bool>(**avatar_); }
+
+  // Everything a rendering of the block depends on that can change without its layout changing
+  struct TileKey {
+    qreal width, device_pixel_ratio;
+    bool bottom_selected, focused, avatar_ready;
+    Selection::Mode mode;
+    std::experimental::optional<Cursor> begin, end; // Selection endpoints within this block
+
+    bool operator==(const TileKey &other) const;
+  };
+
+  // A rendering of the block and its background, discarded whenever the layout changes. Split into strips of
+  // TILE_HEIGHT from the top, rendered only while on screen.
+  struct Tile {
+    TileKey key;
+    std::vector<QPixmap> strips; // Null where not rendered
+    bool selecting;             // Result of draw when rendered
+  };
+
+  std::experimental::optional<Tile> &tile() { return tile_; }
+
 private:
   struct TimeInfo {
     Time start, end;
   };
 
+  struct Shaping;
+  class Shaper;
+
   friend struct Event;
 
   TimelineView &parent_;
@@ -165,9 +281,19 @@ private:
   QTextLayout name_, timestamp_;
   std::experimental::optional<TimeInfo> time_;
   FixedVector<Event> events_;
+  TimelineEventID first_source_;
+  std::size_t source_count_;
+  bool collapsed_;
+  qreal layout_width_;          // Width of the current layout, or negative if not yet laid out
+  mutable qreal estimate_width_, estimate_;
+  std::size_t text_size_;       // Total length of all paragraphs
+  std::shared_ptr<Shaping> shaping_; // Background layout in progress, if any
+  std::experimental::optional<Tile> tile_;
+  bool gap_before_ = false;
 
   qreal avatar_extent() const;
   qreal horizontal_padding() const;
+  std::size_t lay_out_header(qreal width);
   const Event *event_at(const QPointF &) const;
 };
 
@@ -175,10 +301,20 @@ class TimelineView : public QAbstractScrollArea {
   Q_OBJECT
 
 public:
-  TimelineView(const QUrl &homeserver, ThumbnailCache &cache, QWidget *parent = nullptr);
-
-  void prepend(const matrix::TimelineCursor &begin, const matrix::RoomState &state, const matrix::event::Room &evt);
-  void append(const matrix::TimelineCursor &begin, const matrix::RoomState &state, const matrix::event::Room &evt);
+  TimelineView(const QUrl &homeserver, ThumbnailCache &cache, MemoryBudget &budget, QWidget *parent = nullptr);
+  ~TimelineView();
+
+  // Events are in chronological order, and state precedes the first of them
+  void prepend(const matrix::TimelineCursor &begin, const matrix::RoomState &state, gsl::span<const matrix::event::Room> events);
+  void append(const matrix::TimelineCursor &begin, const matrix::RoomState &state, gsl::span<const matrix::event::Room> events);
+  void insert(const matrix::TimelineCursor &after, const matrix::TimelineCursor &begin, const matrix::RoomState &state,
+              gsl::span<const matrix::event::Room> events);
+  // Add events to the batch begin, immediately before the batch after
+  void set_gap(const matrix::TimelineCursor &after, bool open);
+  void clear();
+  // Discard all events, e.g. when the timeline is re-anchored elsewhere in history
+  void scroll_to(const matrix::EventID &event);
+  // Bring event into view as soon as it has been added
   void redact(const matrix::event::room::Redaction &redaction); // Feed from sync
 
   // FIXME: Pending messages should always be rendered according to the most recent room state, not the one when they were sent.
@@ -189,15 +325,26 @@ public:
 
   void set_last_read(const matrix::EventID &id); // Signal event_read only for events following this
 
+  void set_read_markers(std::unordered_map<matrix::EventID, std::size_t> markers);
+  // Events to mark as read, each with the number of users who have read at least that far
+
   std::experimental::optional<matrix::EventID> latest_visible_event() const;
 
   void mark_read();
 
   const QUrl &homeserver() const { return homeserver_; }
 
+  LineCache &line_cache() { return line_cache_; }
+
+  void expand_run(TimelineEventID first);
+  // Show each event of the collapsed membership run beginning with first
+
 signals:
-  void need_backwards();
-  void need_forwards();
+  void need_backwards(std::size_t events);
+  void need_forwards(std::size_t events);
+  // Events is an estimate of how many more events would fill the prefetch margin in that direction
+  void prefetch_cancelled(matrix::Direction dir);
+  // The user is scrolling quickly away from that edge, so fetches beyond what's already needed are wasted
   void discarded_after(const matrix::TimelineCursor &);
   void discarded_before(const matrix::TimelineCursor &);
 
@@ -205,6 +352,9 @@ signals:
   void event_read(const matrix::EventID &id);
   void view_user_profile(const matrix::UserID &user);
 
+  void shaped();
+  // Emitted from a worker thread when a background layout finishes; delivered to this object's thread by a queued connection
+
 protected:
   void paintEvent(QPaintEvent *event) override;
   void resizeEvent(QResizeEvent *event) override;
@@ -216,14 +366,21 @@ protected:
   void contextMenuEvent(QContextMenuEvent *event) override;
   bool viewportEvent(QEvent *event) override;
   void changeEvent(QEvent *event) override;
+  void scrollContentsBy(int dx, int dy) override;
 
 private:
   struct Batch {
     matrix::TimelineCursor begin;
     std::deque<EventLike> events; // TODO: Can't this be real event objects?
+    bool gap_before = false;
+    std::size_t bytes = 0;      // Approximate memory held by the events, including their eventual layout
 
     Batch(matrix::TimelineCursor begin, std::deque<EventLike> events) : begin{std::move(begin)}, events{std::move(events)} {}
-    bool contains(const matrix::EventID &e) const;
+  };
+
+  struct Indexed {
+    EventLike *event;           // Stable, since events are only ever added at either end of a batch or erased with it
+    matrix::TimelineCursor batch;
   };
 
   struct Pending {
@@ -254,36 +411,96 @@ private:
 
   QUrl homeserver_;
   ThumbnailCache &thumbnail_cache_;
-  std::deque<Pending> pending_;
+  MemoryBudget &budget_;
+  std::list<Pending> pending_;
+  std::unordered_map<matrix::TransactionID, std::list<Pending>::iterator> pending_index_;
   std::deque<Batch> batches_;
-  std::deque<EventBlock> blocks_;
+  std::unordered_map<matrix::EventID, Indexed> event_index_;
+  InternTable interned_;
+  std::size_t event_bytes_;     // Sum of the batches' bytes
+  std::deque<std::unique_ptr<EventBlock>> blocks_;
+  FenwickTree<qreal> extents_;  // Of each block from the newest, as in block_extent
+  std::unordered_map<TimelineEventID, std::size_t> block_index_; // Block containing each event, counting from the newest
+  std::unordered_set<TimelineEventID> stale_events_; // Changed since their blocks were built
+  std::unordered_set<TimelineEventID> expanded_runs_; // First events of membership runs not to be collapsed
   std::vector<VisibleBlock> visible_blocks_;
+  std::vector<EventBlock *> tiled_; // Blocks that may hold a tile, i.e. those visible as of compute_visible_blocks
   bool selection_starts_below_view_;
   std::experimental::optional<ScrollPosition> scroll_position_; // relative position of bottom of view
+  std::experimental::optional<matrix::EventID> scroll_target_;
   Selection selection_;
   bool selection_updating_;
   std::chrono::steady_clock::time_point last_click_;
   size_t click_count_;
   QShortcut *copy_;
+  QPointer<QMimeData> primary_; // Our SelectionData, while the clipboard holds it
   QPixmap spinner_;
   bool at_bottom_;
   uint64_t id_counter_;
   std::experimental::optional<matrix::EventID> last_read_;
+  std::unordered_map<matrix::EventID, std::size_t> read_markers_;
 
   bool blocks_dirty_;
 
-  QString selection_text() const;
+  qreal scroll_velocity_;       // pixels per second, positive towards the present
+  int last_scroll_value_;
+  std::chrono::steady_clock::time_point last_scroll_time_;
+  bool adjusting_scroll_;       // Scroll bar changes aren't due to the user
+  qreal event_height_estimate_; // Average height of an event, for converting distances into numbers of events
+
+  QTimer layout_timer_;         // Lays out off-screen blocks a little at a time while idle
+  QThreadPool shaper_pool_;     // Lays out blocks with too much text to do on the GUI thread
+  LineCache line_cache_;
+
+  class SelectionData;
+
+  QString selection_text(const Selection &selection) const;
+  void locate_selection();      // Update selection_starts_below_view_
+  void publish_selection();     // Offer selection_ as the primary selection, without extracting its text until asked
+  void freeze_selection();      // Fix the text of any published selection before selection_ is replaced
   void copy() const;
   QRectF view_rect() const;     // in coordinate space such that (0,0) = bottom-left of latest message
   void update_scrollbar(int content_height);
+  void index(Batch &batch, std::deque<EventLike>::iterator begin, std::deque<EventLike>::iterator end);
+  void unindex(const Batch &batch);
+  EventLike *find_event(const matrix::EventID &id);
+  std::deque<Batch>::iterator batch_of(const matrix::EventID &id);
   void rebuild_blocks();
   void update_layout();
+  qreal layout_width() const;
+  qreal block_height(const EventBlock &block) const; // Exact if laid out at the current width, otherwise estimated
+  qreal block_extent(const EventBlock &block) const; // Including spacing and any gap marker
+  qreal content_extent() const;
+  EventBlock &block_at(std::size_t i); // Counting from the newest
+  void reindex_extents();
+  bool sync_extent(std::size_t i);     // Update extents_ for block i; returns true if it changed
+  bool ensure_layout(std::size_t i, bool wait = false);
+  // Returns true if block i's extent changed. Large blocks are laid out in the background unless wait is set.
+  void refine_layout();
+  void collect_shaped();
+  std::size_t memory_usage() const;
+  void enforce_budget();
+  // Discard batches, farthest first, while this view or all views together are over budget
   void maybe_need_forwards();
+  void track_scroll(int value);
+  qreal prefetch_distance(qreal speed) const;
+  qreal discard_distance(qreal speed) const;
+  std::size_t prefetch_events(qreal distance) const;
   bool at_top() const;
   qreal spinner_space() const;
+  qreal gap_space(const EventBlock &block) const;
   void draw_spinner(QPainter &painter, qreal top) const;
+  void draw_read_markers(QPainter &painter) const;
+  bool draw_block(QPainter &painter, VisibleBlock &block, bool selecting);
+  // Draws from the block's tile, rendering its strips in view first if stale; returns whether the selection continues above
+  bool draw_tile(QPainter &p, EventBlock &block, const QRectF &outline, bool selecting);
+  // Background and contents of a block, in the block's coordinates
+  QRect spinner_rect(qreal top) const; // In viewport coordinates
+  void thumbnails_updated();
   void dispatch_input(const QPointF &point, QEvent *input);
   TimelineEventID get_id();
+  std::experimental::optional<TimelineEventID> take_pending(const matrix::event::Room &evt);
+  // Removes the local echo of evt, if any, returning its ID
   std::experimental::optional<Cursor> get_cursor(const QPointF &point, bool exact) const;
   void compute_visible_blocks();
   void selection_dragged(const QPointF &);
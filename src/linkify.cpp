@@ -0,0 +1,130 @@
+#include "linkify.hpp"
+
+#include <QUrl>
+
+namespace {
+
+uint code_point_at(const QString &text, int i) {
+  const QChar c = text[i];
+  if(c.isHighSurrogate() && i + 1 < text.size() && text[i+1].isLowSurrogate()) {
+    return QChar::surrogateToUcs4(c, text[i+1]);
+  }
+  return c.unicode();
+}
+
+uint code_point_before(const QString &text, int i) {
+  const QChar c = text[i-1];
+  if(c.isLowSurrogate() && i >= 2 && text[i-2].isHighSurrogate()) {
+    return QChar::surrogateToUcs4(text[i-2], c);
+  }
+  return c.unicode();
+}
+
+bool is_word(uint c) {
+  return c == '_' || QChar::isLetterOrNumber(c);
+}
+
+// Regex \b: a word character on exactly one side of i
+bool at_boundary(const QString &text, int i) {
+  const bool before = i > 0 && is_word(code_point_before(text, i));
+  const bool after = i < text.size() && is_word(code_point_at(text, i));
+  return before != after;
+}
+
+bool is_ascii_letter(QChar c) {
+  const auto u = c.unicode();
+  return (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z');
+}
+
+bool is_scheme_char(QChar c) {
+  const auto u = c.unicode();
+  return is_ascii_letter(c) || (u >= '0' && u <= '9') || u == '+' || u == ',' || u == '-' || u == '.';
+}
+
+bool has_prefix(const QString &text, int i, const QLatin1String &prefix) {
+  return text.midRef(i, prefix.size()).compare(prefix, Qt::CaseInsensitive) == 0;
+}
+
+bool is_tld(const QString &text, int i) {
+  return has_prefix(text, i, QLatin1String(".com")) || has_prefix(text, i, QLatin1String(".net"))
+    || has_prefix(text, i, QLatin1String(".org"));
+}
+
+}
+
+std::vector<TextSpan> url_candidates(const QString &text, int offset) {
+  std::vector<TextSpan> result;
+
+  int i = offset;
+  while(i < text.size()) {
+    if(text[i].isSpace()) {
+      ++i;
+      continue;
+    }
+
+    // Every alternative runs to the end of the word except a bare domain without a path, so the word's last TLD and
+    // last dot decide those without rescanning from each start position.
+    const int word_begin = i;
+    int word_end = i;
+    while(word_end < text.size() && !text[word_end].isSpace()) ++word_end;
+    int last_tld = -1, last_dot = -1;
+    for(int j = word_begin; j < word_end; ++j) {
+      if(text[j] != '.') continue;
+      if(j <= word_end - 2) last_dot = j;
+      if(j <= word_end - 4 && is_tld(text, j)) last_tld = j;
+    }
+
+    int scheme_end = word_begin; // Starts before this are known not to be followed by ://
+    int p = word_begin;
+    while(p < word_end) {
+      if(!at_boundary(text, p)) {
+        ++p;
+        continue;
+      }
+
+      int end = -1;
+      if(p >= scheme_end && is_ascii_letter(text[p])) {
+        int q = p + 1;
+        while(q < word_end && is_scheme_char(text[q])) ++q;
+        if(has_prefix(text, q, QLatin1String("://")) && q + 3 < word_end) {
+          end = word_end;
+        } else {
+          scheme_end = q;
+        }
+      }
+      if(end < 0 && last_tld > p) {
+        end = last_tld + 4;
+        if(end < word_end && text[end] == '/') end = word_end;
+      }
+      if(end < 0 && has_prefix(text, p, QLatin1String("www.")) && last_dot >= p + 5) {
+        end = word_end;
+      }
+      if(end < 0 && has_prefix(text, p, QLatin1String("data:")) && p + 5 < word_end) {
+        end = word_end;
+      }
+
+      if(end < 0) {
+        ++p;
+      } else {
+        result.push_back(TextSpan{p, end - p});
+        p = end;
+      }
+    }
+
+    i = word_end;
+  }
+
+  return result;
+}
+
+std::vector<Link> find_links(const QString &text, int offset) {
+  std::vector<Link> result;
+  for(const auto &candidate : url_candidates(text, offset)) {
+    // QUrl doesn't handle some things consistently (e.g. emoticons in .la) so we round-trip it
+    QUrl url(QUrl(text.mid(candidate.start, candidate.length), QUrl::StrictMode).toString(QUrl::FullyEncoded), QUrl::StrictMode);
+    if(!url.isValid()) continue;
+    if(url.scheme().isEmpty()) url = QUrl("http://" + url.toString(QUrl::FullyEncoded), QUrl::StrictMode);
+    result.push_back(Link{candidate.start, candidate.length, url.toString(QUrl::FullyEncoded)});
+  }
+  return result;
+}
@@ -0,0 +1,24 @@
+#ifndef NACHAT_LINKIFY_HPP_
+#define NACHAT_LINKIFY_HPP_
+
+#include <vector>
+
+#include <QString>
+
+struct TextSpan {
+  int start, length;
+};
+
+struct Link {
+  int start, length;
+  QString href;
+};
+
+std::vector<TextSpan> url_candidates(const QString &text, int offset = 0);
+// Spans from offset on that look like URLs: anything with a scheme, www. host, or data: prefix, and words ending in
+// .com, .net, or .org. Single linear pass, equivalent to the regular expression this replaced.
+
+std::vector<Link> find_links(const QString &text, int offset = 0);
+// Candidates that parse as URLs, with the fully encoded URL each should link to
+
+#endif
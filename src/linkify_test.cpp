@@ -0,0 +1,93 @@
+#include <vector>
+
+#include <QCoreApplication>
+#include <QRegularExpression>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include "linkify.hpp"
+
+// Checks url_candidates against the regular expression it replaced and compares their speed on synthetic messages
+
+static bool operator==(const TextSpan &a, const TextSpan &b) { return a.start == b.start && a.length == b.length; }
+
+namespace {
+
+std::vector<TextSpan> regex_candidates(const QString &text) {
+  const static QRegularExpression regex(
+    R"(\b()"
+    R"([a-z][a-z0-9+-.]*://[^\s]+)"
+    R"(|[^\s]+\.(com|net|org)(/[^\s]*)?)"
+    R"(|www\.[^\s]+\.[^\s]+)"
+    R"(|data:[^\s]+)"
+    R"())",
+    QRegularExpression::UseUnicodePropertiesOption | QRegularExpression::OptimizeOnFirstUsageOption | QRegularExpression::CaseInsensitiveOption);
+
+  std::vector<TextSpan> result;
+  auto urls = regex.globalMatch(text);
+  while(urls.hasNext()) {
+    auto candidate = urls.next();
+    result.push_back(TextSpan{candidate.capturedStart(), candidate.capturedLength()});
+  }
+  return result;
+}
+
+std::vector<QString> corpus() {
+  const QStringList words{
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "https://matrix.org/docs/spec", "example.com",
+    "www.example.co.uk", "data:text/plain,hi", "(see", "https://en.wikipedia.org/wiki/URL)", "foo.net/bar?x=1",
+    "ünïcödé", "😀", "mailto:someone@example.org", "a.b.c", "git+ssh://host/repo", "\n", "end.", "_under_score_",
+    "ORG.COM", "http://", "www.", "…", "x://y"};
+  std::vector<QString> result;
+  uint state = 1;
+  auto next = [&]() { state = state * 1103515245 + 12345; return (state >> 16) & 0x7fff; };
+  for(int i = 0; i < 5000; ++i) {
+    QString message;
+    const auto length = next() % 40;
+    for(uint j = 0; j < length; ++j) {
+      if(j != 0) message += ' ';
+      message += words[next() % words.size()];
+    }
+    result.push_back(message);
+  }
+  return result;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QTextStream out(stdout);
+
+  const auto messages = corpus();
+
+  int mismatches = 0;
+  for(const auto &message : messages) {
+    if(!(regex_candidates(message) == url_candidates(message))) {
+      if(mismatches++ < 10) out << "mismatch: " << message << "\n";
+    }
+  }
+  out << mismatches << " mismatches in " << messages.size() << " messages\n";
+
+  const int rounds = 20;
+  std::size_t found = 0;
+  QElapsedTimer timer;
+
+  timer.start();
+  for(int i = 0; i < rounds; ++i) {
+    for(const auto &message : messages) found += regex_candidates(message).size();
+  }
+  const auto regex_ns = timer.nsecsElapsed();
+
+  timer.restart();
+  for(int i = 0; i < rounds; ++i) {
+    for(const auto &message : messages) found += url_candidates(message).size();
+  }
+  const auto scanner_ns = timer.nsecsElapsed();
+
+  out << "regex:   " << regex_ns / 1000000.0 << " ms\n"
+      << "scanner: " << scanner_ns / 1000000.0 << " ms\n"
+      << "(" << found << " candidates)\n";
+
+  return mismatches == 0 ? 0 : 1;
+}
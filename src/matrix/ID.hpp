@@ -54,6 +54,13 @@ struct StateID {
 
 namespace std {
 
+template<>
+struct hash<matrix::TransactionID> {
+  size_t operator()(const matrix::TransactionID &id) const {
+    return qHash(id.value());
+  }
+};
+
 template<>
 struct hash<matrix::EventID> {
   size_t operator()(const matrix::EventID &id) const {
@@ -82,6 +89,13 @@ struct hash<matrix::EventType> {
   }
 };
 
+template<>
+struct hash<matrix::TimelineCursor> {
+  size_t operator()(const matrix::TimelineCursor &id) const {
+    return qHash(id.value());
+  }
+};
+
 template<>
 struct hash<matrix::StateKey> {
   size_t operator()(const matrix::StateKey &id) const {
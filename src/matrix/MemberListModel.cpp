@@ -1,5 +1,7 @@
 #include "MemberListModel.hpp"
 
+#include <algorithm>
+#include <tuple>
 #include <experimental/optional>
 
 #include <QPointer>
@@ -13,44 +15,63 @@ using std::experimental::optional;
 
 namespace matrix {
 
-MemberListModel::Info::Info(UserID id, event::room::MemberContent content, optional<QString> disambiguation) :
-  id{id}, content{content}, disambiguation{disambiguation}
-{}
+constexpr std::size_t RESET_THRESHOLD = 32;
+// Batches of membership changes larger than this reset the model rather than being reported row by row
+
+static bool displayable(Membership m) {
+  return m == Membership::JOIN || m == Membership::INVITE;
+}
+
+bool MemberListModel::KeyCompare::operator()(const Key &a, const Key &b) const {
+  return std::tie(a.activity, a.power, a.name, a.id.value()) < std::tie(b.activity, b.power, b.name, b.id.value());
+}
 
 MemberListModel::MemberListModel(Room &room, QSize icon_size, qreal device_pixel_ratio, QObject *parent) : QAbstractListModel{parent}, room_{room}, icon_size_{icon_size}, device_pixel_ratio_{device_pixel_ratio} {
-  connect(&room, &Room::member_changed, this, &MemberListModel::member_changed);
+  connect(&room, &Room::members_changed, this, &MemberListModel::members_changed);
   connect(&room, &Room::member_disambiguation_changed, this, &MemberListModel::member_disambiguation_changed);
+  connect(&room, &Room::message, this, &MemberListModel::message);
+  connect(&room, &Room::power_levels_changed, this, &MemberListModel::power_levels_changed);
+
+  std::unordered_map<UserID, uint64_t> activity;
+  for(const auto &batch : room.buffer()) {
+    for(const auto &evt : batch.events) {
+      auto &ts = activity[evt.sender()];
+      ts = std::max(ts, evt.origin_server_ts());
+    }
+  }
 
   auto members = room.state().members();
-  beginInsertRows(QModelIndex(), 0, members.size()-1);
   members_.reserve(members.size());
-  for(auto member: members) {
-    index_.emplace(member->first, members_.size());
-    members_.emplace_back(member->first, member->second, room_.state().member_disambiguation(member->first));
-    queue_fetch(members_.back());
+  for(auto member : members) {
+    auto it = activity.find(member->first);
+    members_.emplace(member->first, Entry{member->second, make_key(member->first, member->second, it == activity.end() ? 0 : it->second)});
   }
-  endInsertRows();
+  rebuild_order();
 }
 
 int MemberListModel::rowCount(const QModelIndex &parent) const {
   if(parent != QModelIndex()) return 0;
-  return members_.size();
+  return order_.size();
 }
 
 QVariant MemberListModel::data(const QModelIndex &index, int role) const {
-  if(index.column() != 0 || static_cast<size_t>(index.row()) >= members_.size()) {
+  if(index.column() != 0 || index.row() < 0 || static_cast<size_t>(index.row()) >= order_.size()) {
     return QVariant();
   }
-  const auto &info = members_[index.row()];
+  const auto &id = order_.at(index.row()).id;
+  const auto &member = members_.at(id);
   switch(role) {
   case Qt::DisplayRole:
   case Qt::EditRole:
-    return pretty_name(info.id, info.content);
+    return pretty_name(id, member.content);
   case Qt::ToolTipRole:
   case IDRole:
-    return info.id.value();
+    return id.value();
   case Qt::DecorationRole: {
-    if(auto avatar = info.avatar) {
+    // Fetched by fetch_avatars once the row is displayed
+    auto it = avatars_.find(id);
+    if(it == avatars_.end()) return QVariant();
+    if(auto &avatar = it->second) {
       return *avatar;
     }
     return QVariant();
@@ -60,6 +81,14 @@ QVariant MemberListModel::data(const QModelIndex &index, int role) const {
   }
 }
 
+void MemberListModel::fetch_avatars(int first, int last) {
+  for(int row = std::max(first, 0); row <= last && static_cast<size_t>(row) < order_.size(); ++row) {
+    const auto &id = order_.at(row).id;
+    if(avatars_.count(id)) continue;
+    queue_fetch(id, members_.at(id).content);
+  }
+}
+
 QVariant MemberListModel::headerData(int section, Qt::Orientation orientation, int role) const {
   if(role != Qt::DisplayRole || section != 0) {
     return QVariant();
@@ -72,77 +101,131 @@ QVariant MemberListModel::headerData(int section, Qt::Orientation orientation, i
   return QVariant();
 }
 
-void MemberListModel::member_changed(const UserID &id, const event::room::MemberContent &current, const event::room::MemberContent &next) {
-  switch(current.membership()) {
-  case Membership::LEAVE:
-  case Membership::BAN:
-    switch(next.membership()) {
-    case Membership::JOIN:
-    case Membership::INVITE:
-      beginInsertRows(QModelIndex(), members_.size(), members_.size());
-      index_.emplace(id, members_.size());
-      members_.emplace_back(id, next, room_.state().nonmember_disambiguation(id, next.displayname()));
-      endInsertRows();
-      break;
-
-    case Membership::LEAVE:
-    case Membership::BAN:
-      break;
-    }
-    break;
-
-  case Membership::JOIN:
-  case Membership::INVITE:
-    switch(next.membership()) {
-    case Membership::LEAVE:
-    case Membership::BAN: {
-      auto it = index_.find(id);
-      beginRemoveRows(QModelIndex(), it->second, it->second);
-      if(it->second != members_.size() - 1) {
-        layoutAboutToBeChanged();
-        auto &swap_target = members_[it->second];
-        std::swap(swap_target, members_.back());
-        std::swap(index_.at(swap_target.id), it->second);
-        changePersistentIndex(index(members_.size()-1), index(it->second));
-        layoutChanged();
-      }
-      members_.pop_back();
-      index_.erase(it);
-      endRemoveRows();
-      break;
+auto MemberListModel::make_key(const UserID &id, const event::room::MemberContent &content, uint64_t activity) const -> Key {
+  return Key{-static_cast<int64_t>(activity), -room_.state().power_level(id), pretty_name(id, content).toCaseFolded(), id};
+}
+
+void MemberListModel::rebuild_order() {
+  std::vector<Key> keys;
+  keys.reserve(members_.size());
+  for(const auto &member : members_) {
+    keys.push_back(member.second.key);
+  }
+  std::sort(keys.begin(), keys.end(), KeyCompare());
+  order_.assign(std::move(keys));
+}
+
+void MemberListModel::reorder(Entry &member, Key key) {
+  const int from = order_.rank(member.key);
+  const int to = order_.rank(key);  // Row before which the member will land, counting the member's current row
+  const bool moved = to != from && to != from + 1;
+  if(moved) beginMoveRows(QModelIndex(), from, from, QModelIndex(), to);
+  order_.erase(member.key);
+  const int row = order_.insert(key);
+  member.key = std::move(key);
+  if(moved) endMoveRows();
+  dataChanged(index(row), index(row));
+}
+
+void MemberListModel::members_changed(gsl::span<const MemberChange> changes) {
+  if(static_cast<std::size_t>(changes.size()) <= RESET_THRESHOLD) {
+    for(const auto &change : changes) {
+      update_member(change.user, change.next);
     }
+    return;
+  }
 
-    case Membership::JOIN:
-    case Membership::INVITE: {
-      std::size_t i = index_.at(id);
-      bool update_avatar = members_[i].content.avatar_url() != next.avatar_url();
-      members_[i].content = next;
-      members_[i].disambiguation = room_.state().member_disambiguation(id);
-      dataChanged(index(i), index(i));
-      if(update_avatar) {
-        queue_fetch(members_[i]);
+  // Scattered single-row notifications for thousands of members, e.g. on joining a large room, make views relayout
+  // once per row, so apply the whole batch and re-sort once instead.
+  beginResetModel();
+  for(const auto &change : changes) {
+    auto it = members_.find(change.user);
+    if(!displayable(change.next.membership())) {
+      if(it != members_.end()) {
+        members_.erase(it);
+        avatars_.erase(change.user);
       }
-      break;
+      continue;
+    }
+    if(it == members_.end()) {
+      members_.emplace(change.user, Entry{change.next, make_key(change.user, change.next, 0)});
+      continue;
     }
+    if(it->second.content.avatar_url() != change.next.avatar_url()) {
+      avatars_.erase(change.user);
     }
-    break;
+    it->second.content = change.next;
+    it->second.key = make_key(change.user, change.next, -it->second.key.activity);
+  }
+  rebuild_order();
+  endResetModel();
+}
+
+void MemberListModel::update_member(const UserID &id, const event::room::MemberContent &next) {
+  auto it = members_.find(id);
+  if(!displayable(next.membership())) {
+    if(it == members_.end()) return;
+    const int row = order_.rank(it->second.key);
+    beginRemoveRows(QModelIndex(), row, row);
+    order_.erase(it->second.key);
+    members_.erase(it);
+    avatars_.erase(id);
+    endRemoveRows();
+    return;
+  }
+
+  if(it == members_.end()) {
+    auto key = make_key(id, next, 0);
+    const int row = order_.rank(key);
+    beginInsertRows(QModelIndex(), row, row);
+    order_.insert(key);
+    members_.emplace(id, Entry{next, std::move(key)});
+    endInsertRows();
+    return;
+  }
+
+  auto &member = it->second;
+  if(member.content.avatar_url() != next.avatar_url()) {
+    avatars_.erase(id);  // Refetched when next displayed
   }
+  member.content = next;
+  reorder(member, make_key(id, next, -member.key.activity));
 }
 
 void MemberListModel::member_disambiguation_changed(const UserID &id, const optional<QString> &old, const optional<QString> &current) {
   (void)old;
-  std::size_t i = index_.at(id);
-  members_[i].disambiguation = current;
-  dataChanged(index(i), index(i));
+  (void)current;
+  auto it = members_.find(id);
+  if(it == members_.end()) return;
+  const int row = order_.rank(it->second.key);
+  dataChanged(index(row), index(row));
+}
+
+void MemberListModel::message(const event::Room &evt) {
+  auto it = members_.find(evt.sender());
+  if(it == members_.end()) return;
+  auto &member = it->second;
+  const auto ts = evt.origin_server_ts();
+  if(static_cast<uint64_t>(-member.key.activity) >= ts) return;
+  reorder(member, make_key(it->first, member.content, ts));
+}
+
+void MemberListModel::power_levels_changed() {
+  beginResetModel();
+  for(auto &member : members_) {
+    member.second.key = make_key(member.first, member.second.content, -member.second.key.activity);
+  }
+  rebuild_order();
+  endResetModel();
 }
 
-// TODO: Replace queue with view-dependent fetching
-void MemberListModel::queue_fetch(const Info &info) {
-  QUrl url(info.content.avatar_url().value_or(QString()), QUrl::StrictMode);
+void MemberListModel::queue_fetch(const UserID &id, const event::room::MemberContent &content) {
+  avatars_[id];
+  QUrl url(content.avatar_url().value_or(QString()), QUrl::StrictMode);
   if(!url.isValid()) return;
 
   bool first_fetch = avatar_fetch_queue_.empty();
-  avatar_fetch_queue_[info.id] = url;
+  avatar_fetch_queue_[id] = url;
   if(first_fetch) do_fetch();
 }
 
@@ -159,31 +242,36 @@ void MemberListModel::do_fetch() {
         (void)disposition;
         if(!self) return;
 
-        auto it = self->index_.find(id);
-        if(it == self->index_.end()) return;
-        
-        QPixmap pixmap = decode(type, data);
+        auto it = self->members_.find(id);
+        auto avatar = self->avatars_.find(id);
+        if(it != self->members_.end() && avatar != self->avatars_.end()
+           && QUrl(it->second.content.avatar_url().value_or(QString()), QUrl::StrictMode) == url) {
+          QPixmap pixmap = decode(type, data);
 
-        if(pixmap.width() > thumbnail.size().width() || pixmap.height() > thumbnail.size().height())
-          pixmap = pixmap.scaled(thumbnail.size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-        pixmap.setDevicePixelRatio(self->device_pixel_ratio_);
+          if(pixmap.width() > thumbnail.size().width() || pixmap.height() > thumbnail.size().height())
+            pixmap = pixmap.scaled(thumbnail.size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+          pixmap.setDevicePixelRatio(self->device_pixel_ratio_);
 
-        self->members_[it->second].avatar = std::move(pixmap);
-        self->dataChanged(index(it->second), index(it->second));
+          avatar->second = std::move(pixmap);
+          const int row = self->order_.rank(it->second.key);
+          self->dataChanged(self->index(row), self->index(row));
+        }
         self->finish_fetch(id, url);
       });
     connect(fetch, &matrix::ContentFetch::error, [=](const QString &msg) {
+        (void)msg;
         if(!self) return;
         self->finish_fetch(id, url);
       });
   } catch(matrix::illegal_content_scheme &e) {
     qDebug() << "ignoring avatar with illegal scheme" << url.scheme() << "for user" << id.value();
+    finish_fetch(id, url);
   }
 }
 
 void MemberListModel::finish_fetch(UserID id, QUrl url) {
   auto queue_it = avatar_fetch_queue_.find(id);
-  if(queue_it->second == url) {
+  if(queue_it != avatar_fetch_queue_.end() && queue_it->second == url) {
     avatar_fetch_queue_.erase(queue_it);
   }
   if(!avatar_fetch_queue_.empty()) {
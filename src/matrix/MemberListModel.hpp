@@ -1,20 +1,23 @@
 #ifndef NACHAT_MATRIX_MEMBER_LIST_MODEL_HPP_
 #define NACHAT_MATRIX_MEMBER_LIST_MODEL_HPP_
 
-#include <vector>
 #include <unordered_map>
 #include <experimental/optional>
 
+#include <span.h>
+
 #include <QAbstractListModel>
 #include <QPixmap>
 #include <QUrl>
 
 #include "ID.hpp"
 #include "Event.hpp"
+#include "OrderStatisticTree.hpp"
 
 namespace matrix {
 class Room;
 class ContentFetch;
+struct MemberChange;
 
 class MemberListModel : public QAbstractListModel {
 public:
@@ -26,27 +29,48 @@ public:
   QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
   QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
 
+  void fetch_avatars(int first, int last);
+  // Request avatars not yet requested for rows first through last, e.g. those a view is displaying
+
 private:
-  struct Info {
+  // Rows are ordered by most recent activity, then power level, then case-folded name, with the ID as a tiebreaker
+  // so that keys are unique. Activity and power are negated so every field sorts ascending.
+  struct Key {
+    int64_t activity;
+    int64_t power;
+    QString name;
     UserID id;
-    event::room::MemberContent content;
-    std::experimental::optional<QString> disambiguation;
-    std::experimental::optional<QPixmap> avatar;
+  };
 
-    Info(UserID, event::room::MemberContent, std::experimental::optional<QString>);
+  struct KeyCompare {
+    bool operator()(const Key &a, const Key &b) const;
+  };
+
+  struct Entry {
+    event::room::MemberContent content;
+    Key key;
   };
 
   Room &room_;
-  std::vector<Info> members_;
-  std::unordered_map<UserID, std::size_t> index_;
+  std::unordered_map<UserID, Entry> members_;
+  OrderStatisticTree<Key, KeyCompare> order_;
   QSize icon_size_;
   qreal device_pixel_ratio_;
+  std::unordered_map<UserID, std::experimental::optional<QPixmap>> avatars_;
+  // Present once a fetch has been requested for a displayed row; empty until it completes
   std::unordered_map<UserID, QUrl> avatar_fetch_queue_;
 
-  void member_changed(const UserID &id, const event::room::MemberContent &old, const event::room::MemberContent &current);
+  Key make_key(const UserID &id, const event::room::MemberContent &content, uint64_t activity) const;
+  void rebuild_order();
+  void reorder(Entry &member, Key key);
+
+  void members_changed(gsl::span<const MemberChange> changes);
+  void update_member(const UserID &id, const event::room::MemberContent &next);
   void member_disambiguation_changed(const UserID &id, const std::experimental::optional<QString> &old, const std::experimental::optional<QString> &current);
+  void message(const event::Room &evt);
+  void power_levels_changed();
 
-  void queue_fetch(const Info &info);
+  void queue_fetch(const UserID &id, const event::room::MemberContent &content);
   void do_fetch();
   void finish_fetch(UserID id, QUrl url);
 };
@@ -0,0 +1,217 @@
+#ifndef NACHAT_MATRIX_ORDER_STATISTIC_TREE_HPP_
+#define NACHAT_MATRIX_ORDER_STATISTIC_TREE_HPP_
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace matrix {
+
+// Treap of unique elements augmented with subtree sizes, giving expected O(log n) insertion, removal, rank, and
+// selection by rank.
+template<typename T, typename Compare = std::less<T>>
+class OrderStatisticTree {
+public:
+  explicit OrderStatisticTree(Compare compare = Compare()) : compare_{std::move(compare)} {}
+
+  OrderStatisticTree(const OrderStatisticTree &) = delete;
+  OrderStatisticTree &operator=(const OrderStatisticTree &) = delete;
+  OrderStatisticTree(OrderStatisticTree &&) = default;
+  OrderStatisticTree &operator=(OrderStatisticTree &&) = default;
+
+  std::size_t size() const noexcept { return size_of(root_.get()); }
+  bool empty() const noexcept { return !root_; }
+
+  void clear() noexcept { root_.reset(); }
+
+  void assign(std::vector<T> sorted);
+  // Replace contents with elements already sorted according to Compare, in O(n)
+
+  std::size_t insert(T value);
+  // Returns the rank of the new element
+
+  std::size_t erase(const T &value);
+  // Returns the rank the erased element had. Throws std::out_of_range if absent.
+
+  std::size_t rank(const T &value) const;
+  // Number of elements ordered before value, whether or not value is present
+
+  bool contains(const T &value) const;
+
+  const T &at(std::size_t rank) const;
+
+private:
+  struct Node {
+    T value;
+    std::uint32_t priority;
+    std::size_t size;
+    std::unique_ptr<Node> left, right;
+
+    Node(T value, std::uint32_t priority) : value{std::move(value)}, priority{priority}, size{1} {}
+  };
+  using Ptr = std::unique_ptr<Node>;
+
+  Compare compare_;
+  Ptr root_;
+  std::minstd_rand rng_;
+
+  static std::size_t size_of(const Node *n) noexcept { return n ? n->size : 0; }
+  static void update(Node &n) noexcept { n.size = 1 + size_of(n.left.get()) + size_of(n.right.get()); }
+
+  bool goes_left(const T &x, const T &pivot, bool inclusive) const {
+    return compare_(x, pivot) || (inclusive && !compare_(pivot, x));
+  }
+
+  void split(Ptr t, const T &pivot, bool inclusive, Ptr &left, Ptr &right) const;
+  // Partition t into elements before pivot (or equal to it, if inclusive) and the rest
+
+  static Ptr merge(Ptr left, Ptr right);
+  // All elements of left must precede all elements of right
+
+  Ptr build(std::vector<T> &sorted, std::size_t begin, std::size_t end);
+};
+
+template<typename T, typename Compare>
+void OrderStatisticTree<T, Compare>::assign(std::vector<T> sorted) {
+  root_ = build(sorted, 0, sorted.size());
+
+  // Random priorities handed out in descending order breadth-first satisfy the heap invariant without disturbing the
+  // perfectly balanced shape
+  std::vector<std::uint32_t> priorities(sorted.size());
+  for(auto &p : priorities) p = rng_();
+  std::sort(priorities.begin(), priorities.end(), std::greater<std::uint32_t>());
+
+  std::deque<Node *> queue;
+  if(root_) queue.push_back(root_.get());
+  auto priority = priorities.begin();
+  while(!queue.empty()) {
+    auto node = queue.front();
+    queue.pop_front();
+    node->priority = *priority++;
+    if(node->left) queue.push_back(node->left.get());
+    if(node->right) queue.push_back(node->right.get());
+  }
+}
+
+template<typename T, typename Compare>
+auto OrderStatisticTree<T, Compare>::build(std::vector<T> &sorted, std::size_t begin, std::size_t end) -> Ptr {
+  if(begin == end) return nullptr;
+  const std::size_t mid = begin + (end - begin) / 2;
+  auto node = std::make_unique<Node>(std::move(sorted[mid]), 0);
+  node->left = build(sorted, begin, mid);
+  node->right = build(sorted, mid + 1, end);
+  update(*node);
+  return node;
+}
+
+template<typename T, typename Compare>
+std::size_t OrderStatisticTree<T, Compare>::insert(T value) {
+  Ptr left, right;
+  split(std::move(root_), value, false, left, right);
+  const std::size_t result = size_of(left.get());
+  auto node = std::make_unique<Node>(std::move(value), rng_());
+  root_ = merge(merge(std::move(left), std::move(node)), std::move(right));
+  return result;
+}
+
+template<typename T, typename Compare>
+std::size_t OrderStatisticTree<T, Compare>::erase(const T &value) {
+  Ptr left, middle, right;
+  split(std::move(root_), value, false, left, right);
+  split(std::move(right), value, true, middle, right);
+  const std::size_t result = size_of(left.get());
+  const bool found = static_cast<bool>(middle);
+  root_ = merge(std::move(left), std::move(right));
+  if(!found) throw std::out_of_range("erased element not present in order statistic tree");
+  return result;
+}
+
+template<typename T, typename Compare>
+std::size_t OrderStatisticTree<T, Compare>::rank(const T &value) const {
+  std::size_t result = 0;
+  const Node *n = root_.get();
+  while(n) {
+    if(compare_(n->value, value)) {
+      result += size_of(n->left.get()) + 1;
+      n = n->right.get();
+    } else {
+      n = n->left.get();
+    }
+  }
+  return result;
+}
+
+template<typename T, typename Compare>
+bool OrderStatisticTree<T, Compare>::contains(const T &value) const {
+  const Node *n = root_.get();
+  while(n) {
+    if(compare_(n->value, value)) {
+      n = n->right.get();
+    } else if(compare_(value, n->value)) {
+      n = n->left.get();
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename T, typename Compare>
+const T &OrderStatisticTree<T, Compare>::at(std::size_t rank) const {
+  if(rank >= size()) throw std::out_of_range("rank exceeds order statistic tree size");
+  const Node *n = root_.get();
+  while(true) {
+    const auto left = size_of(n->left.get());
+    if(rank < left) {
+      n = n->left.get();
+    } else if(rank == left) {
+      return n->value;
+    } else {
+      rank -= left + 1;
+      n = n->right.get();
+    }
+  }
+}
+
+template<typename T, typename Compare>
+void OrderStatisticTree<T, Compare>::split(Ptr t, const T &pivot, bool inclusive, Ptr &left, Ptr &right) const {
+  if(!t) {
+    left.reset();
+    right.reset();
+    return;
+  }
+  if(goes_left(t->value, pivot, inclusive)) {
+    split(std::move(t->right), pivot, inclusive, t->right, right);
+    update(*t);
+    left = std::move(t);
+  } else {
+    split(std::move(t->left), pivot, inclusive, left, t->left);
+    update(*t);
+    right = std::move(t);
+  }
+}
+
+template<typename T, typename Compare>
+auto OrderStatisticTree<T, Compare>::merge(Ptr left, Ptr right) -> Ptr {
+  if(!left) return right;
+  if(!right) return left;
+  if(left->priority > right->priority) {
+    left->right = merge(std::move(left->right), std::move(right));
+    update(*left);
+    return left;
+  }
+  right->left = merge(std::move(left), std::move(right->left));
+  update(*right);
+  return right;
+}
+
+}
+
+#endif
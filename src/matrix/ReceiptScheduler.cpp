@@ -0,0 +1,85 @@
+#include "ReceiptScheduler.hpp"
+
+#include <algorithm>
+
+#include "Room.hpp"
+#include "Session.hpp"
+
+namespace matrix {
+
+ReceiptScheduler::ReceiptScheduler(std::chrono::steady_clock::duration delay, QObject *parent)
+  : QObject{parent}, delay_{delay} {
+  timer_.setSingleShot(true);
+  connect(&timer_, &QTimer::timeout, this, &ReceiptScheduler::send_due);
+}
+
+void ReceiptScheduler::schedule(Room &room, const EventID &event) {
+  if(!is_newer(room, event)) return;
+
+  auto it = pending_.find(room.id());
+  if(it != pending_.end()) {
+    // Keep the original deadline so that continuous activity can't postpone the receipt indefinitely
+    if(room.position(event) >= room.position(it->second.event)) {
+      it->second.event = event;
+    }
+    return;
+  }
+
+  const auto due = std::chrono::steady_clock::now() + delay_;
+  pending_.emplace(room.id(), Pending{&room, event, due});
+  if(!timer_.isActive()) {
+    timer_.start(std::chrono::duration_cast<std::chrono::milliseconds>(delay_).count());
+  }
+}
+
+void ReceiptScheduler::flush() {
+  timer_.stop();
+  for(const auto &p : pending_) {
+    send(p.second);
+  }
+  pending_.clear();
+}
+
+bool ReceiptScheduler::is_newer(const Room &room, const EventID &event) const {
+  auto is_after = [&](const EventID &baseline) {
+    if(baseline == event) return false;
+    const auto event_pos = room.position(event), baseline_pos = room.position(baseline);
+    if(event_pos && baseline_pos) return *event_pos > *baseline_pos;
+    // Unpositioned events are older than everything in the buffer. If neither is positioned, we can't tell.
+    return !baseline_pos;
+  };
+
+  auto sent = sent_.find(room.id());
+  if(sent != sent_.end() && !is_after(sent->second)) return false;
+  if(auto own = room.receipt_from(room.session().user_id())) {
+    if(!is_after(own->event)) return false;
+  }
+  return true;
+}
+
+void ReceiptScheduler::send_due() {
+  const auto now = std::chrono::steady_clock::now();
+  auto next = std::chrono::steady_clock::time_point::max();
+  for(auto it = pending_.begin(); it != pending_.end();) {
+    if(it->second.due <= now) {
+      send(it->second);
+      it = pending_.erase(it);
+    } else {
+      next = std::min(next, it->second.due);
+      ++it;
+    }
+  }
+  if(!pending_.empty()) {
+    timer_.start(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count());
+  }
+}
+
+void ReceiptScheduler::send(const Pending &p) {
+  // Rechecked in case a receipt for a later event arrived from another client in the meantime
+  if(!is_newer(*p.room, p.event)) return;
+  sent_.erase(p.room->id());
+  sent_.emplace(p.room->id(), p.event);
+  p.room->send_read_receipt(p.event);
+}
+
+}
@@ -0,0 +1,49 @@
+#ifndef NACHAT_MATRIX_RECEIPT_SCHEDULER_HPP_
+#define NACHAT_MATRIX_RECEIPT_SCHEDULER_HPP_
+
+#include <unordered_map>
+#include <chrono>
+
+#include <QObject>
+#include <QTimer>
+
+#include "ID.hpp"
+
+namespace matrix {
+
+class Room;
+
+// Coalesces read receipts so that rapidly reading through rooms costs at most one request per room per delay, and
+// never reports an event older than one already reported.
+class ReceiptScheduler : public QObject {
+  Q_OBJECT
+
+public:
+  explicit ReceiptScheduler(std::chrono::steady_clock::duration delay, QObject *parent = nullptr);
+
+  void schedule(Room &room, const EventID &event);
+  // Send a read receipt and fully-read marker for event at most delay from now, unless superseded
+
+  void flush();
+  // Send everything scheduled immediately
+
+private:
+  struct Pending {
+    Room *room;
+    EventID event;
+    std::chrono::steady_clock::time_point due;
+  };
+
+  const std::chrono::steady_clock::duration delay_;
+  std::unordered_map<RoomID, Pending> pending_;
+  std::unordered_map<RoomID, EventID> sent_;
+  QTimer timer_;
+
+  bool is_newer(const Room &room, const EventID &event) const;
+  void send_due();
+  void send(const Pending &p);
+};
+
+}
+
+#endif
@@ -40,9 +40,12 @@ RoomState::RoomState(const QJsonObject &info, gsl::span<const Member> members) {
                    return v.toString();
                  });
 
+  set_power_levels(info["power_levels"].toObject());
+
   members_by_id_.reserve(members.size());
   for(const auto &member : members) {
     members_by_id_.insert(member);
+    member_ids_.insert(member.first);
     if(member.second.displayname()) {
       record_displayname(member.first, *member.second.displayname(), nullptr);
     }
@@ -64,28 +67,53 @@ QJsonObject RoomState::to_json() const {
   }
   o["aliases"] = std::move(aa);
 
+  QJsonObject users;
+  for(const auto &x : power_levels_) {
+    users[x.first.value()] = static_cast<double>(x.second);
+  }
+  o["power_levels"] = QJsonObject{{"users", std::move(users)}, {"users_default", static_cast<double>(users_default_)}};
+
   return o;
 }
 
+void RoomState::set_power_levels(const QJsonObject &content) {
+  power_levels_.clear();
+  const auto users = content["users"].toObject();
+  power_levels_.reserve(users.size());
+  for(auto it = users.begin(); it != users.end(); ++it) {
+    power_levels_.emplace(UserID{it.key()}, static_cast<int64_t>(it.value().toDouble()));
+  }
+  users_default_ = content["users_default"].toDouble(0);
+}
+
+int64_t RoomState::power_level(const UserID &user) const {
+  auto it = power_levels_.find(user);
+  if(it == power_levels_.end()) return users_default_;
+  return it->second;
+}
+
 QString RoomState::pretty_name(const UserID &own_id) const {
+  if(pretty_name_ && pretty_name_->own_id == own_id) return pretty_name_->name;
+  pretty_name_ = CachedName{own_id, compute_pretty_name(own_id)};
+  return pretty_name_->name;
+}
+
+QString RoomState::compute_pretty_name(const UserID &own_id) const {
   if(name_ && !name_->isEmpty()) return *name_;
   if(canonical_alias_) return *canonical_alias_;
   if(!aliases_.empty()) return aliases_[0];  // Non-standard, but matches vector-web
-  auto ms = members();
-  ms.erase(std::remove_if(ms.begin(), ms.end(), [&](const Member *m){
-        return m->first == own_id;
-      }), ms.end());
-  if(ms.size() > 1) {
-    std::partial_sort(ms.begin(), ms.begin() + 2, ms.end(),
-                      [](const Member *a, const Member *b) {
-                        return a->first < b->first;
-                      });
-  }
-  switch(ms.size()) {
+  const Member *heroes[2];
+  size_t hero_count = 0;
+  for(auto it = member_ids_.begin(); it != member_ids_.end() && hero_count < 2; ++it) {
+    if(*it == own_id) continue;
+    heroes[hero_count++] = &*members_by_id_.find(*it);
+  }
+  const size_t others = member_ids_.size() - member_ids_.count(own_id);
+  switch(others) {
   case 0: return Room::tr("Empty room");
-  case 1: return matrix::pretty_name(ms[0]->first, ms[0]->second);
-  case 2: return Room::tr("%1 and %2").arg(member_name(ms[0]->first)).arg(member_name(ms[1]->first));
-  default: return Room::tr("%1 and %2 others").arg(member_name(ms[0]->first)).arg(ms.size() - 1);
+  case 1: return matrix::pretty_name(heroes[0]->first, heroes[0]->second);
+  case 2: return Room::tr("%1 and %2").arg(member_name(heroes[0]->first)).arg(member_name(heroes[1]->first));
+  default: return Room::tr("%1 and %2 others").arg(member_name(heroes[0]->first)).arg(others - 1);
   }
 }
 
@@ -174,6 +202,7 @@ const event::room::MemberContent *RoomState::member_from_id(const UserID &id) co
 }
 
 static constexpr std::chrono::steady_clock::duration MINIMUM_BACKOFF(std::chrono::seconds(5));
+static constexpr std::size_t TIMELINE_CACHE_EVENTS = 2000;
 // Default synapse seconds-per-message when throttled
 
 static std::deque<Batch> parse_buffer(QJsonValue v) {
@@ -186,29 +215,32 @@ static std::deque<Batch> parse_buffer(QJsonValue v) {
 }
 
 Room::Room(Matrix &universe, Session &session, RoomID id, const QJsonObject &initial,
-           gsl::span<const Member> members)
+           gsl::span<const Member> members, gsl::span<const Receipt> receipts)
     : universe_(universe), session_(session), id_(std::move(id)),
       state_{initial["state"].toObject(), members},
       buffer_{parse_buffer(initial["buffer"])},
       highlight_count_{static_cast<uint64_t>(initial["highlight_count"].toDouble(0))},
       notification_count_{static_cast<uint64_t>(initial["notification_count"].toDouble(0))},
-      transmitting_(nullptr), retry_backoff_(MINIMUM_BACKOFF)
+      unread_count_{static_cast<uint64_t>(initial["unread_count"].toDouble(0))}
 {
   transmit_retry_timer_.setSingleShot(true);
-  connect(&transmit_retry_timer_, &QTimer::timeout, this, &Room::transmit_event);
+  connect(&transmit_retry_timer_, &QTimer::timeout, this, &Room::transmit);
 
-  auto receipts = initial["receipts"].toObject();
-  for(auto it = receipts.begin(); it != receipts.end(); ++it) {
-    update_receipt(UserID(it.key()), EventID(it.value().toObject()["event_id"].toString()), it.value().toObject()["ts"].toDouble());
+  for(const auto &batch : buffer_) {
+    index_batch(batch);
+  }
+
+  receipts_by_user_.reserve(receipts.size());
+  for(const auto &receipt : receipts) {
+    update_receipt(receipt.user, receipt.event, receipt.ts);
   }
 }
 
 Room::Room(Matrix &universe, Session &session, const proto::JoinedRoom &joined_room)
-    : universe_(universe), session_(session), id_{joined_room.id},
-      transmitting_(nullptr), retry_backoff_(MINIMUM_BACKOFF)
+    : universe_(universe), session_(session), id_{joined_room.id}
 {
   transmit_retry_timer_.setSingleShot(true);
-  connect(&transmit_retry_timer_, &QTimer::timeout, this, &Room::transmit_event);
+  connect(&transmit_retry_timer_, &QTimer::timeout, this, &Room::transmit);
 
   dispatch(joined_room);
 }
@@ -237,11 +269,6 @@ QJsonObject Batch::to_json() const {
 }
 
 QJsonObject Room::to_json() const {
-  QJsonObject o;
-  QJsonObject receipts;
-  for(const auto &receipt : receipts_by_user_) {
-    receipts[receipt.first.value()] = QJsonObject{{"event_id", receipt.second.event.value()}, {"ts", static_cast<qint64>(receipt.second.ts)}};
-  }
   QJsonArray buffer_array;
   for(const auto &batch : buffer()) {
     buffer_array.push_back(batch.to_json());
@@ -250,7 +277,7 @@ QJsonObject Room::to_json() const {
     {"state", state_.to_json()},
     {"highlight_count", static_cast<double>(highlight_count_)},
     {"notification_count", static_cast<double>(notification_count_)},
-    {"receipts", receipts},
+    {"unread_count", static_cast<double>(unread_count_)},
     {"buffer", buffer_array},
   };
 }
@@ -260,6 +287,15 @@ bool Room::dispatch(const proto::JoinedRoom &joined) {
 
   sync_start(joined.timeline);
 
+  {
+    auto is_member = [](const event::Room &e) { return e.type() == event::room::Member::tag(); };
+    const std::size_t member_events =
+      std::count_if(joined.state.events.begin(), joined.state.events.end(), is_member)
+      + std::count_if(joined.timeline.events.begin(), joined.timeline.events.end(), is_member);
+    state_.reserve_members(member_events);
+    member_changes_.reserve(member_events);
+  }
+
   for(auto &state : joined.state.events) {
     try {
       state_touched |= state_.dispatch(state, this);
@@ -310,16 +346,59 @@ bool Room::dispatch(const proto::JoinedRoom &joined) {
     }
   }
 
+  if(!member_changes_.empty()) {
+    members_changed(member_changes_);
+    member_changes_.clear();
+  }
+
+  if(!joined.timeline.events.empty()) {
+    if(auto cache = timeline_cache_.lock()) {
+      if(joined.timeline.next_batch) cache->insert(joined.timeline.prev_batch, *joined.timeline.next_batch, joined.timeline.events);
+    }
+
+    // Buffered before receipts are processed so that receipts for new events can be positioned immediately
+    buffer_.emplace_back(joined.timeline.prev_batch, joined.timeline.events);
+    index_batch(buffer_.back());
+    unread_count_ += std::count_if(joined.timeline.events.begin(), joined.timeline.events.end(),
+                                   [this](const event::Room &e) { return counts_as_unread(e); });
+
+    size_t buffer_evts = std::accumulate(buffer().begin(), buffer().end(), 0, [](size_t c, const Batch &x) {  return c + x.events.size(); });
+    while(buffer_.size() > 1 && buffer_evts > session().buffer_size()) {
+      buffer_evts -= buffer_.front().events.size();
+      {
+        // Evicted messages were counted only if they followed our receipt
+        const auto receipt = receipt_from(session().user_id());
+        const auto receipt_pos = receipt ? position(receipt->event) : optional<uint64_t>();
+        for(const auto &evt : buffer_.front().events) {
+          if(!counts_as_unread(evt) || unread_count_ == 0) continue;
+          const auto pos = position(evt.id());
+          if(!receipt_pos || !pos || *pos > *receipt_pos) {
+            --unread_count_;
+          }
+        }
+      }
+      unindex_batch(buffer_.front());
+      buffer_.pop_front();
+    }
+  }
+
   for(const auto &evt : joined.ephemeral.events) {
     if(evt.type() == event::Receipt::tag()) {
       const auto content = evt.content().json();
       for(auto read_evt = content.begin(); read_evt != content.end(); ++read_evt) {
         const auto obj = read_evt.value().toObject()["m.read"].toObject();
         for(auto user = obj.begin(); user != obj.end(); ++user) {
-          update_receipt(UserID(user.key()), EventID(read_evt.key()), user.value().toObject()["ts"].toDouble());
+          UserID id(user.key());
+          if(update_receipt(id, EventID(read_evt.key()), user.value().toObject()["ts"].toDouble())) {
+            if(id == session().user_id()) recount_unread();
+            receipt_changes_.push_back(std::move(id));
+          }
         }
       }
-      receipts_changed();
+      if(!receipt_changes_.empty()) {
+        receipts_changed(receipt_changes_);
+        receipt_changes_.clear();
+      }
     } else if(evt.type() == event::Typing::tag()) {
       typing_ = event::Typing(evt).user_ids();
       typing_changed();
@@ -328,16 +407,6 @@ bool Room::dispatch(const proto::JoinedRoom &joined) {
     }
   }
 
-  if(!joined.timeline.events.empty()) {
-    buffer_.emplace_back(joined.timeline.prev_batch, joined.timeline.events);
-
-    size_t buffer_evts = std::accumulate(buffer().begin(), buffer().end(), 0, [](size_t c, const Batch &x) {  return c + x.events.size(); });
-    while(buffer_.size() > 1 && buffer_evts > session().buffer_size()) {
-      buffer_evts -= buffer_.front().events.size();
-      buffer_.pop_front();
-    }
-  }
-
   sync_complete(joined.timeline);
 
   if(state_touched) {
@@ -347,10 +416,15 @@ bool Room::dispatch(const proto::JoinedRoom &joined) {
   return state_touched;
 }
 
+void RoomState::reserve_members(std::size_t additional) {
+  members_by_id_.reserve(members_by_id_.size() + additional);
+}
+
 bool RoomState::update_membership(const UserID &user_id, const event::room::MemberContent &content, Room *room) {
   auto it = members_by_id_.find(user_id);
+  pretty_name_ = {};
   if(room) {
-    room->member_changed(user_id, it != members_by_id_.end() ? it->second : event::room::MemberContent::leave, content);
+    room->member_changes_.push_back(MemberChange{user_id, it != members_by_id_.end() ? it->second : event::room::MemberContent::leave, content});
   }
 
   switch(content.membership()) {
@@ -361,6 +435,7 @@ bool RoomState::update_membership(const UserID &user_id, const event::room::Memb
         std::piecewise_construct,
         std::forward_as_tuple(user_id),
         std::forward_as_tuple(event::room::MemberContent::leave)).first;
+      member_ids_.insert(user_id);
     }
     auto &member = it->second;;
     if(content.displayname() != member.displayname()) {
@@ -383,6 +458,7 @@ bool RoomState::update_membership(const UserID &user_id, const event::room::Memb
         forget_displayname(user_id, *member.displayname(), room);
       }
       members_by_id_.erase(it);
+      member_ids_.erase(user_id);
     }
     break;
   }
@@ -395,6 +471,7 @@ bool RoomState::dispatch(const event::room::State &state, Room *room) {
   if(state.type() == event::room::Aliases::tag()) {
     std::unordered_set<QString, QStringHash> all_aliases;
     auto data = event::room::Aliases(state).aliases();  // FIXME: Need to validate these before using them
+    pretty_name_ = {};
     all_aliases.reserve(aliases_.size() + data.size());
 
     std::move(aliases_.begin(), aliases_.end(), std::inserter(all_aliases, all_aliases.end()));
@@ -410,6 +487,7 @@ bool RoomState::dispatch(const event::room::State &state, Room *room) {
   }
   if(state.type() == event::room::CanonicalAlias::tag()) {
     event::room::CanonicalAlias ca{state};
+    pretty_name_ = {};
     auto old = std::move(canonical_alias_);
     canonical_alias_ = ca.alias();
     if(room && canonical_alias_ != old) room->canonical_alias_changed();
@@ -417,6 +495,7 @@ bool RoomState::dispatch(const event::room::State &state, Room *room) {
   }
   if(state.type() == event::room::Name::tag()) {
     event::room::Name n{state};
+    pretty_name_ = {};
     auto old = std::move(name_);
     name_ = n.content().name();
     if(room && name_ != old) room->name_changed();
@@ -438,6 +517,12 @@ bool RoomState::dispatch(const event::room::State &state, Room *room) {
     if(room && avatar_ != old) room->avatar_changed();
     return true;
   }
+  if(state.type() == event::room::PowerLevels::tag()) {
+    event::room::PowerLevels p{state};
+    set_power_levels(p.content().json());
+    if(room) room->power_levels_changed();
+    return true;
+  }
   if(state.type() == event::room::Create::tag()) {
     // Nothing to do here, because our rooms data structures are created implicitly
     return false;
@@ -452,6 +537,7 @@ bool RoomState::dispatch(const event::room::State &state, Room *room) {
 }
 
 void RoomState::revert(const event::room::State &state) {
+  pretty_name_ = {};
   if(state.type() == event::room::CanonicalAlias::tag()) {
     canonical_alias_ = event::room::CanonicalAlias(state).prev_alias();
     return;
@@ -477,6 +563,11 @@ void RoomState::revert(const event::room::State &state) {
       avatar_ = QUrl();
     return;
   }
+  if(state.type() == event::room::PowerLevels::tag()) {
+    auto c = state.prev_content();
+    set_power_levels(c ? c->json() : QJsonObject());
+    return;
+  }
   if(state.type() == event::room::Member::tag()) {
     event::room::Member member(state);
     update_membership(member.user(),
@@ -486,6 +577,23 @@ void RoomState::revert(const event::room::State &state) {
   }
 }
 
+std::shared_ptr<TimelineCache> Room::timeline_cache() {
+  auto cache = timeline_cache_.lock();
+  if(!cache) {
+    cache = std::make_shared<TimelineCache>(TIMELINE_CACHE_EVENTS);
+    timeline_cache_ = cache;
+  }
+  session_.retain_timeline(cache);
+  return cache;
+}
+
+void MessageFetch::cancel() {
+  blockSignals(true);
+  if(auto reply = qobject_cast<QNetworkReply *>(parent())) {
+    reply->abort();
+  }
+}
+
 MessageFetch *Room::get_messages(Direction dir, const TimelineCursor &from, uint64_t limit, optional<TimelineCursor> to) {
   QUrlQuery query;
   query.addQueryItem("from", from.value());
@@ -539,6 +647,65 @@ MessageFetch *Room::get_messages(Direction dir, const TimelineCursor &from, uint
   return result;
 }
 
+void ContextFetch::cancel() {
+  blockSignals(true);
+  if(auto reply = qobject_cast<QNetworkReply *>(parent())) {
+    reply->abort();
+  }
+}
+
+ContextFetch *Room::get_context(const EventID &event, uint64_t limit) {
+  QUrlQuery query;
+  if(limit != 0) query.addQueryItem("limit", QString::number(limit));
+  auto reply = session_.get(QString("client/r0/rooms/" % QUrl::toPercentEncoding(id_.value()) % "/context/"
+                                    % QUrl::toPercentEncoding(event.value())), query);
+  auto result = new ContextFetch(reply);
+  connect(reply, &QNetworkReply::finished, [reply, result]() {
+      auto r = decode(reply);
+      if(r.error) {
+        result->error(*r.error);
+        return;
+      }
+
+      auto start_val = r.object["start"], end_val = r.object["end"];
+      if(!start_val.isString() || !end_val.isString()) {
+        result->error("invalid or missing \"start\" or \"end\" attribute in server's response");
+        return;
+      }
+      if(!r.object["event"].isObject()) {
+        result->error("invalid or missing \"event\" attribute in server's response");
+        return;
+      }
+
+      const auto before = r.object["events_before"].toArray(), after = r.object["events_after"].toArray();
+      std::vector<event::Room> events;
+      events.reserve(before.size() + 1 + after.size());
+      RoomState state;
+      const char *error = nullptr;
+      try {
+        // events_before is in reverse chronological order
+        std::transform(before.begin(), before.end(), std::back_inserter(events),
+                       [](const QJsonValue &v) { return event::Room(event::Identifiable(Event(v.toObject()))); });
+        std::reverse(events.begin(), events.end());
+        events.emplace_back(event::Identifiable(Event(r.object["event"].toObject())));
+        std::transform(after.begin(), after.end(), std::back_inserter(events),
+                       [](const QJsonValue &v) { return event::Room(event::Identifiable(Event(v.toObject()))); });
+        for(const auto &s : r.object["state"].toArray()) {
+          state.apply(event::room::State(event::Room(event::Identifiable(Event(s.toObject())))));
+        }
+      } catch(const malformed_event &e) {
+        error = e.what();
+      }
+      if(error) {
+        result->error(tr("malformed event: %1").arg(error));
+      } else {
+        result->finished(TimelineCursor{start_val.toString()}, TimelineCursor{end_val.toString()}, events,
+                         before.size(), state);
+      }
+    });
+  return result;
+}
+
 EventSend *Room::leave() {
   auto reply = session_.post(QString("client/r0/rooms/" % QUrl::toPercentEncoding(id_.value()) % "/leave"));
   auto es = new EventSend(reply);
@@ -555,7 +722,8 @@ EventSend *Room::leave() {
 
 TransactionID Room::send(const EventType &type, event::Content content) {
   pending_events_.push_back({session_.get_transaction_id(), type, std::move(content)});
-  transmit_event();
+  transmissions_.push_back(Transmission{nullptr, false, MINIMUM_BACKOFF, {}});
+  transmit();
   return pending_events_.back().transaction_id;
 }
 
@@ -586,6 +754,30 @@ TransactionID Room::send_file(const QString &uri, const QString &name, const QSt
                 }});
 }
 
+TransactionID Room::send_image(const QString &uri, const QString &name, const QString &media_type, size_t size, QSize dimensions,
+                              const optional<ImageThumbnail> &thumbnail) {
+  QJsonObject info{
+    {"mimetype", media_type},
+    {"size", static_cast<qint64>(size)},
+    {"w", dimensions.width()},
+    {"h", dimensions.height()}};
+  if(thumbnail) {
+    info["thumbnail_url"] = thumbnail->uri;
+    info["thumbnail_info"] = QJsonObject{
+      {"mimetype", thumbnail->media_type},
+      {"size", static_cast<qint64>(thumbnail->size)},
+      {"w", thumbnail->dimensions.width()},
+      {"h", thumbnail->dimensions.height()}};
+  }
+  return send(event::room::Message::tag(),
+              event::Content{{
+                    {"msgtype", "m.image"},
+                    {"url", uri},
+                    {"body", name},
+                    {"info", std::move(info)}
+                }});
+}
+
 TransactionID Room::send_message(const QString &body) {
   return send(event::room::Message::tag(),
               event::Content{{
@@ -601,7 +793,8 @@ TransactionID Room::send_emote(const QString &body) {
 }
 
 void Room::send_read_receipt(const EventID &event) {
-  auto reply = session_.post(QString("client/r0/rooms/" % QUrl::toPercentEncoding(id_.value()) % "/receipt/m.read/" % QUrl::toPercentEncoding(event.value())));
+  auto reply = session_.post(QString("client/r0/rooms/" % QUrl::toPercentEncoding(id_.value()) % "/read_markers"),
+                             QJsonObject{{"m.fully_read", event.value()}, {"m.read", event.value()}});
   auto es = new EventSend(reply);
   connect(reply, &QNetworkReply::finished, [reply, es, event]() {
       if(reply->error()) {
@@ -616,84 +809,203 @@ void Room::send_read_receipt(const EventID &event) {
 gsl::span<const Room::Receipt * const> Room::receipts_for(const EventID &id) const {
   auto it = receipts_by_event_.find(id);
   if(it == receipts_by_event_.end()) return {};
-  return gsl::span<const Room::Receipt * const>(static_cast<const Receipt * const *>(it->second.data()),
-                                                  it->second.size());
+  return it->second;
 }
 
 const Room::Receipt *Room::receipt_from(const UserID &id) const {
   auto it = receipts_by_user_.find(id);
   if(it == receipts_by_user_.end()) return nullptr;
-  return &it->second;
+  return &it->second.receipt;
+}
+
+std::vector<const Room::Receipt *> Room::receipts() const {
+  std::vector<const Receipt *> result;
+  result.reserve(receipts_by_user_.size());
+  for(const auto &x : receipts_by_user_) {
+    result.push_back(&x.second.receipt);
+  }
+  return result;
 }
 
-void Room::update_receipt(const UserID &user, const EventID &event, uint64_t ts) {
-  const Receipt new_value{event, ts};
-  auto emplaced = receipts_by_user_.emplace(user, new_value);
+optional<uint64_t> Room::position(const EventID &id) const {
+  auto it = event_positions_.find(id);
+  if(it == event_positions_.end()) return {};
+  return it->second;
+}
+
+std::size_t Room::readers_at_or_after(const EventID &id) const {
+  auto position = event_positions_.find(id);
+  if(position == event_positions_.end()) return 0;
+  return readers_by_position_.total() - readers_by_position_.prefix(position->second - first_position_);
+}
+
+bool Room::update_receipt(const UserID &user, const EventID &event, uint64_t ts) {
+  auto emplaced = receipts_by_user_.emplace(user, ReceiptEntry{Receipt{user, event, ts}, 0});
+  auto &entry = emplaced.first->second;
   if(!emplaced.second) {
-    auto it = receipts_by_event_.find(emplaced.first->second.event);
-    if(it != receipts_by_event_.end()) {
-      auto &vec = it->second;
-      // Remove from index
-      vec.erase(std::remove(vec.begin(), vec.end(), &emplaced.first->second), vec.end());
-      if(vec.empty()) {
-        receipts_by_event_.erase(it);
-      }
+    entry.receipt.ts = ts;
+    if(entry.receipt.event == event) return false;
+    forget_receipt(entry);
+    entry.receipt.event = event;
+  }
+
+  auto &readers = receipts_by_event_[event];
+  entry.slot = readers.size();
+  readers.push_back(&entry.receipt);
+
+  auto position = event_positions_.find(event);
+  if(position != event_positions_.end()) {
+    const auto i = position->second - first_position_;
+    readers_by_position_.set(i, readers_by_position_[i] + 1);
+  }
+  return true;
+}
+
+void Room::forget_receipt(const ReceiptEntry &entry) {
+  auto it = receipts_by_event_.find(entry.receipt.event);
+  auto &readers = it->second;
+  // Swap-and-pop, fixing up the slot of whichever receipt was moved into the hole
+  readers[entry.slot] = readers.back();
+  receipts_by_user_.at(readers[entry.slot]->user).slot = entry.slot;
+  readers.pop_back();
+  if(readers.empty()) {
+    receipts_by_event_.erase(it);
+  }
+
+  auto position = event_positions_.find(entry.receipt.event);
+  if(position != event_positions_.end()) {
+    const auto i = position->second - first_position_;
+    readers_by_position_.set(i, readers_by_position_[i] - 1);
+  }
+}
+
+void Room::index_batch(const Batch &batch) {
+  for(const auto &evt : batch.events) {
+    const auto position = next_position_++;
+    std::size_t readers = 0;
+    if(event_positions_.emplace(evt.id(), position).second) {
+      auto it = receipts_by_event_.find(evt.id());
+      if(it != receipts_by_event_.end()) readers = it->second.size();
     }
-    emplaced.first->second = new_value;
+    readers_by_position_.push_back(readers);
+  }
+}
+
+void Room::unindex_batch(const Batch &batch) {
+  for(const auto &evt : batch.events) {
+    auto position = event_positions_.find(evt.id());
+    if(position == event_positions_.end()) continue;
+    event_positions_.erase(position);
   }
-  receipts_by_event_[event].push_back(&emplaced.first->second);
+
+  // Batches leave from the front, so theirs are always the oldest positions
+  std::vector<std::size_t> rest;
+  rest.reserve(readers_by_position_.size() - batch.events.size());
+  for(std::size_t i = batch.events.size(); i < readers_by_position_.size(); ++i) {
+    rest.push_back(readers_by_position_[i]);
+  }
+  readers_by_position_.assign(std::move(rest));
+  first_position_ += batch.events.size();
 }
 
-void Room::transmit_event() {
-  if(transmitting_) return;     // We'll be re-invoked when necessary by transmit_finished
+void Room::transmit() {
+  using namespace std::chrono;
+
+  const auto now = steady_clock::now();
+  std::size_t in_flight = std::count_if(transmissions_.begin(), transmissions_.end(),
+                                        [](const Transmission &t) { return t.reply != nullptr; });
+  optional<steady_clock::time_point> next_retry;
+  for(std::size_t i = 0; i < pending_events_.size() && in_flight < session_.send_window(); ++i) {
+    auto &t = transmissions_[i];
+    if(t.delivered || t.reply) continue;
+    if(t.retry_at && *t.retry_at > now) {
+      // Sending anything past an event awaiting retry would deliver it out of order
+      next_retry = t.retry_at;
+      break;
+    }
+    t.retry_at = {};
+
+    const auto &event = pending_events_[i];
+    const auto txn = event.transaction_id;
+    auto reply = session_.put(QString{"client/r0/rooms/" % QUrl::toPercentEncoding(id_.value())
+          % "/send/" % QUrl::toPercentEncoding(event.type.value()) % "/" % QUrl::toPercentEncoding(txn.value())},
+      event.content.json());
+    t.reply = reply;
+    connect(reply, &QNetworkReply::finished, this, [this, reply, txn]() { transmit_finished(reply, txn); });
+    ++in_flight;
+  }
 
-  const auto &event = pending_events_.front();
-  transmitting_ = session_.put(QString{"client/r0/rooms/" % QUrl::toPercentEncoding(id_.value())
-        % "/send/" % QUrl::toPercentEncoding(event.type.value()) % "/" % QUrl::toPercentEncoding(event.transaction_id.value())},
-    event.content.json());
-  connect(transmitting_, &QNetworkReply::finished, this, &Room::transmit_finished);
+  if(next_retry) {
+    transmit_retry_timer_.start(std::max<milliseconds::rep>(0, duration_cast<milliseconds>(*next_retry - now).count()));
+  }
 }
 
-void Room::transmit_finished() {
+void Room::transmit_finished(QNetworkReply *reply, const TransactionID &txn) {
   using namespace std::chrono;
   using namespace std::chrono_literals;
 
-  auto r = decode(transmitting_);
-  transmitting_ = nullptr;
-  bool retrying = false;
+  auto it = std::find_if(pending_events_.begin(), pending_events_.end(),
+                         [&](const PendingEvent &e) { return e.transaction_id == txn; });
+  if(it == pending_events_.end()) return;
+  const std::size_t index = it - pending_events_.begin();
+  auto &t = transmissions_[index];
+  t.reply = nullptr;
+
+  auto r = decode(reply);
   if(r.code >= 400 && r.code < 500 && r.code != 429) {
     // HTTP client errors other than rate-limiting are unrecoverable
     error(*r.error);
-    pending_events_.pop_front();
+    t.delivered = true;
   } else if(!r.error) {
-    pending_events_.pop_front();
+    t.delivered = true;
   } else {
-    retrying = true;
-    qDebug() << "retrying send in" << duration_cast<duration<float>>(retry_backoff_).count() << "seconds due to error:" << *r.error;
-  }
-  if(!retrying) {
-    retry_backoff_ = MINIMUM_BACKOFF;
-  }
-  if(!pending_events_.empty()) {
-    if(retrying) {
-      transmit_retry_timer_.start(duration_cast<milliseconds>(retry_backoff_).count());
-      retry_backoff_ = std::min<steady_clock::duration>(30s, duration_cast<steady_clock::duration>(1.25 * retry_backoff_));
-    } else {
-      transmit_event();
+    auto delay = t.backoff;
+    if(r.code == 429) {
+      delay = std::max<steady_clock::duration>(delay, milliseconds(static_cast<milliseconds::rep>(r.object["retry_after_ms"].toDouble())));
     }
+    qDebug() << "retrying send in" << duration_cast<duration<float>>(delay).count() << "seconds due to error:" << *r.error;
+    t.retry_at = steady_clock::now() + delay;
+    t.backoff = std::min<steady_clock::duration>(30s, duration_cast<steady_clock::duration>(1.25 * t.backoff));
+
+    // Later events still in flight would otherwise land ahead of the retry, so send them again after it instead
+    for(std::size_t i = index + 1; i < transmissions_.size(); ++i) {
+      auto &later = transmissions_[i];
+      if(!later.reply) continue;
+      disconnect(later.reply, nullptr, this, nullptr);
+      later.reply->abort();
+      later.reply = nullptr;
+    }
+  }
+
+  // Events leave the queue strictly in order, so pending_events() never has gaps
+  while(!pending_events_.empty() && transmissions_.front().delivered) {
+    pending_events_.pop_front();
+    transmissions_.pop_front();
   }
+
+  transmit();
 }
 
 bool Room::has_unread() const {
+  if(unread_count_ != 0) return true;
+  // If our receipt isn't in the buffer, there may be unread messages we haven't seen
+  auto receipt = receipt_from(session().user_id());
+  return !receipt || !position(receipt->event);
+}
+
+bool Room::counts_as_unread(const event::Room &evt) const {
+  return evt.type() == event::room::Message::tag() && evt.sender() != session().user_id();
+}
+
+void Room::recount_unread() {
+  unread_count_ = 0;
   auto receipt = receipt_from(session().user_id());
-  if(!receipt) return true;
   for(auto batch = buffer().rbegin(); batch != buffer().rend(); ++batch) {
     for(auto event = batch->events.rbegin(); event != batch->events.rend(); ++event) {
-      if(receipt->event == event->id()) return false;
-      if(event->type() == event::room::Message::tag() && event->sender() != session().user_id()) return true;
+      if(receipt && receipt->event == event->id()) return;
+      if(counts_as_unread(*event)) ++unread_count_;
     }
   }
-  return true;
 }
 
 }
@@ -3,19 +3,24 @@
 
 #include <vector>
 #include <unordered_map>
+#include <set>
 #include <deque>
 #include <chrono>
+#include <memory>
 
 #include <QString>
 #include <QObject>
 #include <QUrl>
 #include <QTimer>
+#include <QSize>
 
 #include <span.h>
 
 #include "../QStringHash.hpp"
+#include "../FenwickTree.hpp"
 
 #include "Event.hpp"
+#include "TimelineCache.hpp"
 
 class QNetworkReply;
 
@@ -36,6 +41,11 @@ inline QString pretty_name(const UserID &user, const event::room::MemberContent
 
 using Member = std::pair<const UserID, event::room::MemberContent>;
 
+struct MemberChange {
+  UserID user;
+  event::room::MemberContent prev, next;
+};
+
 class RoomState {
 public:
   RoomState() = default;  // New, empty room
@@ -47,19 +57,24 @@ public:
   void revert(const event::room::State &e);  // Reverts an event that, if a state event, has prev_content
 
   bool dispatch(const event::room::State &e, Room *room);
-  // Returns true if changes were made. Emits state change events on room if supplied.
+  // Returns true if changes were made. Emits state change events on room if supplied, except for membership changes,
+  // which are queued on room to be reported together.
+
+  void reserve_members(std::size_t additional);
+  // Prepare for a burst of membership changes, e.g. when joining a large room
 
   const std::experimental::optional<QString> &name() const { return name_; }
   const std::experimental::optional<QString> &canonical_alias() const { return canonical_alias_; }
   gsl::span<const QString> aliases() const { return aliases_; }
   const std::experimental::optional<QString> &topic() const { return topic_; }
   const QUrl &avatar() const { return avatar_; }
+  int64_t power_level(const UserID &user) const;
 
   std::vector<const Member *> members() const;
   const event::room::MemberContent *member_from_id(const UserID &id) const;
 
   QString pretty_name(const UserID &own_id) const;
-  // Matrix r0.1.0 11.2.2.5 ish (like vector-web)
+  // Matrix r0.1.0 11.2.2.5 ish (like vector-web). Cached until a name, alias, or membership change.
 
   std::experimental::optional<QString> member_disambiguation(const UserID &member) const;
   std::experimental::optional<QString> nonmember_disambiguation(const UserID &id, const std::experimental::optional<QString> &displayname) const;
@@ -75,12 +90,24 @@ private:
   QUrl avatar_;
   std::unordered_map<UserID, event::room::MemberContent> members_by_id_;
   std::unordered_map<QString, std::vector<UserID>, QStringHash> members_by_displayname_;
+  std::set<UserID> member_ids_;  // Ordered so the members a room is named after can be found without sorting
+  std::unordered_map<UserID, int64_t> power_levels_;
+  int64_t users_default_ = 0;
+
+  struct CachedName {
+    UserID own_id;
+    QString name;
+  };
+  mutable std::experimental::optional<CachedName> pretty_name_;
 
   void forget_displayname(const UserID &member, const QString &old_name, Room *room);
   void record_displayname(const UserID &member, const QString &name, Room *room);
   std::vector<UserID> &members_named(QString displayname);
   const std::vector<UserID> &members_named(QString displayname) const;
 
+  void set_power_levels(const QJsonObject &content);
+  QString compute_pretty_name(const UserID &own_id) const;
+
   bool update_membership(const UserID &user_id, const event::room::MemberContent &content, Room *room);
 };
 
@@ -90,11 +117,30 @@ class MessageFetch : public QObject {
 public:
   MessageFetch(QObject *parent = nullptr) : QObject(parent) {}
 
+  void cancel();
+  // Abort the request; no further signals will be emitted
+
 signals:
   void finished(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events);
   void error(const QString &message);
 };
 
+class ContextFetch : public QObject {
+  Q_OBJECT
+
+public:
+  ContextFetch(QObject *parent = nullptr) : QObject(parent) {}
+
+  void cancel();
+  // Abort the request; no further signals will be emitted
+
+signals:
+  void finished(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+                std::size_t target, const RoomState &state);
+  // events are in chronological order, events[target] is the requested event, and state follows the last event
+  void error(const QString &message);
+};
+
 class EventSend : public QObject {
   Q_OBJECT
 
@@ -116,11 +162,19 @@ struct Batch {
   QJsonObject to_json() const;
 };
 
+struct ImageThumbnail {
+  QString uri;
+  QString media_type;
+  size_t size;
+  QSize dimensions;
+};
+
 class Room : public QObject {
   Q_OBJECT
 
 public:
   struct Receipt {
+    UserID user;
     EventID event;
     uint64_t ts;
   };
@@ -132,7 +186,7 @@ public:
   };
 
   Room(Matrix &universe, Session &session, RoomID id, const QJsonObject &initial,
-       gsl::span<const Member> members);
+       gsl::span<const Member> members, gsl::span<const Receipt> receipts);
   Room(Matrix &universe, Session &session, const proto::JoinedRoom &joined_room);
 
   Room(const Room &) = delete;
@@ -157,6 +211,9 @@ public:
 
   MessageFetch *get_messages(Direction dir, const TimelineCursor &from, uint64_t limit = 0, std::experimental::optional<TimelineCursor> to = {});
 
+  ContextFetch *get_context(const EventID &event, uint64_t limit = 0);
+  // Fetch an event with up to limit events of context around it, e.g. to open the timeline somewhere in history
+
   EventSend *leave();
 
   TransactionID send(const EventType &type, event::Content content);
@@ -164,24 +221,39 @@ public:
   TransactionID redact(const EventID &event, const QString &reason = "");
 
   TransactionID send_file(const QString &uri, const QString &name, const QString &media_type, size_t size);
+  TransactionID send_image(const QString &uri, const QString &name, const QString &media_type, size_t size, QSize dimensions,
+                           const std::experimental::optional<ImageThumbnail> &thumbnail = {});
   TransactionID send_message(const QString &body);
   TransactionID send_emote(const QString &body);
 
   void send_read_receipt(const EventID &event);
+  // Immediately moves both the read receipt and the fully-read marker. See Session::schedule_read_receipt.
 
   gsl::span<const UserID> typing() const { return typing_; }
   gsl::span<const Receipt * const> receipts_for(const EventID &id) const;
+  // Users whose read receipt is on exactly this event
   const Receipt *receipt_from(const UserID &id) const;
+  std::vector<const Receipt *> receipts() const;
+  std::experimental::optional<uint64_t> position(const EventID &id) const;
+  // Increases through time; present only for events in the buffer
+  std::size_t readers_at_or_after(const EventID &id) const;
+  // Number of users whose read receipt is on this event or a later one. Only events in the buffer are considered.
 
   const std::deque<PendingEvent> &pending_events() const { return pending_events_; }
   // Events that have not yet been successfully transmitted
 
   const std::deque<Batch> &buffer() const { return buffer_; }
 
+  std::shared_ptr<TimelineCache> timeline_cache();
+  // Shared by all timeline windows on this room, and retained by the session for a while after they're gone
+
   bool has_unread() const;
+  uint64_t unread_count() const { return unread_count_; }
+  // Messages from other users following our read receipt. Maintained incrementally, so both are cheap.
 
 signals:
-  void member_changed(const UserID &, const event::room::MemberContent &current, const event::room::MemberContent &next);
+  void members_changed(gsl::span<const MemberChange> changes);
+  // Emitted once per sync with every membership change it contained, in order
   void member_disambiguation_changed(const UserID &, const std::experimental::optional<QString> &current, const std::experimental::optional<QString> &next);
   void state_changed();
   void highlight_count_changed(uint64_t old);
@@ -191,8 +263,9 @@ signals:
   void aliases_changed();
   void topic_changed(const std::experimental::optional<QString> &old);
   void avatar_changed();
+  void power_levels_changed();
   void typing_changed();
-  void receipts_changed();
+  void receipts_changed(gsl::span<const UserID> users);
 
   void sync_start(const proto::Timeline &);
   void sync_complete(const proto::Timeline &);
@@ -205,30 +278,63 @@ signals:
   void left(Membership reason);
 
 private:
+  friend class RoomState;
+
   Matrix &universe_;
   Session &session_;
   const RoomID id_;
 
   RoomState state_;
   std::deque<Batch> buffer_;
+  std::weak_ptr<TimelineCache> timeline_cache_;
+  std::vector<MemberChange> member_changes_;  // Accumulated by state_ during dispatch
 
   uint64_t highlight_count_ = 0, notification_count_ = 0;
+  uint64_t unread_count_ = 0;  // Counts only buffered events
 
-  std::unordered_map<EventID, std::vector<Receipt *>> receipts_by_event_;
-  std::unordered_map<UserID, Receipt> receipts_by_user_;
+  struct ReceiptEntry {
+    Receipt receipt;
+    std::size_t slot;  // Index in receipts_by_event_, so that moving a receipt is O(1)
+  };
+
+  std::unordered_map<EventID, std::vector<const Receipt *>> receipts_by_event_;
+  std::unordered_map<UserID, ReceiptEntry> receipts_by_user_;
+  std::vector<UserID> receipt_changes_;
+
+  std::unordered_map<EventID, uint64_t> event_positions_;  // Increasing through time; covers events in buffer_
+  uint64_t first_position_ = 0;  // Of the oldest event in buffer_
+  uint64_t next_position_ = 0;
+  FenwickTree<std::size_t> readers_by_position_;  // Number of receipts on each position from first_position_ on
 
   std::vector<UserID> typing_;
 
-  // State used for reliable in-order message delivery in send, transmit_event, and transmit_finished
+  struct Transmission {
+    QNetworkReply *reply;  // Non-null while in flight
+    bool delivered;
+    std::chrono::steady_clock::duration backoff;
+    std::experimental::optional<std::chrono::steady_clock::time_point> retry_at;
+  };
+
+  // State used for reliable message delivery in send, transmit, and transmit_finished. Up to Session::send_window()
+  // events are in flight at once; with the default of one, each is sent only once the previous has been acknowledged,
+  // so delivery is strictly in order. With a larger window, requests in flight together may be processed by the server
+  // in either order. Transaction IDs make retries idempotent.
   std::deque<PendingEvent> pending_events_;
-  QNetworkReply *transmitting_;
-  QTimer transmit_retry_timer_;
-  std::chrono::steady_clock::duration retry_backoff_;
+  std::deque<Transmission> transmissions_;  // Parallel to pending_events_
+  QTimer transmit_retry_timer_;  // Fires when the earliest failed event is due to be retried
+
+  bool update_receipt(const UserID &user, const EventID &event, uint64_t ts);
+  // Returns true if the user's receipt moved
+  void forget_receipt(const ReceiptEntry &entry);
+
+  void index_batch(const Batch &batch);
+  void unindex_batch(const Batch &batch);
 
-  void update_receipt(const UserID &user, const EventID &event, uint64_t ts);
+  bool counts_as_unread(const event::Room &evt) const;
+  void recount_unread();
 
-  void transmit_event();
-  void transmit_finished();
+  void transmit();
+  void transmit_finished(QNetworkReply *reply, const TransactionID &txn);
 };
 
 }
@@ -1,6 +1,7 @@
 #include "Session.hpp"
 
 #include <stdexcept>
+#include <algorithm>
 
 #include <QtNetwork>
 #include <QTimer>
@@ -12,13 +13,18 @@
 
 namespace matrix {
 
-constexpr uint64_t CACHE_FORMAT_VERSION = 5;
+constexpr uint64_t CACHE_FORMAT_VERSION = 8;
 // Bumped every time a backwards-incompatible format change is made, a
 // corruption bug is fixed, or a previously ignored class of state is
 // persisted
 
 static constexpr char POLL_TIMEOUT_MS[] = "50000";
 
+using namespace std::chrono_literals;
+static constexpr std::chrono::steady_clock::duration RECEIPT_DELAY = 2s;
+
+static constexpr std::size_t RETAINED_TIMELINES = 8;
+
 static const lmdb::val next_batch_key("next_batch");
 static const lmdb::val transaction_id_key("transaction_id");
 static const lmdb::val cache_format_version_key("cache_format_version");
@@ -43,12 +49,13 @@ struct SessionInit {
   lmdb::env env;
   lmdb::dbi state;
   lmdb::dbi room;
+  lmdb::dbi receipts;
 };
 
 static SessionInit session_init(const UserID &user_id) {
   auto env = lmdb::env::create();
   env.set_mapsize(128UL * 1024UL * 1024UL);  // 128MB should be enough for anyone!
-  env.set_max_dbs(1024UL);                   // maximum rooms plus two
+  env.set_max_dbs(1024UL);                   // maximum rooms plus three
 
   QString state_path = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) % "/" % QString::fromUtf8(user_id.value().toUtf8().toHex() % "/state");
   bool fresh = !QFile::exists(state_path);
@@ -73,6 +80,7 @@ static SessionInit session_init(const UserID &user_id) {
   auto txn = lmdb::txn::begin(env);
   auto state_db = lmdb::dbi::open(txn, "state", MDB_CREATE);
   auto room_db = lmdb::dbi::open(txn, "rooms", MDB_CREATE);
+  auto receipt_db = lmdb::dbi::open(txn, "receipts", MDB_CREATE);
 
   if(!fresh) {
     bool compatible = false;
@@ -84,6 +92,7 @@ static SessionInit session_init(const UserID &user_id) {
       qDebug() << "resetting cache due to breaking changes or fixes";
       lmdb::dbi_drop(txn, state_db, false);
       lmdb::dbi_drop(txn, room_db, false);
+      lmdb::dbi_drop(txn, receipt_db, false);
       fresh = true;
     }
   }
@@ -97,7 +106,37 @@ static SessionInit session_init(const UserID &user_id) {
 
   txn.commit();
 
-  return SessionInit{std::move(env), std::move(state_db), std::move(room_db)};
+  return SessionInit{std::move(env), std::move(state_db), std::move(room_db), std::move(receipt_db)};
+}
+
+static QByteArray receipt_prefix(const RoomID &room) {
+  QByteArray result = room.value().toUtf8();
+  result.append('\0');
+  return result;
+}
+
+static QByteArray receipt_key(const RoomID &room, const UserID &user) {
+  return receipt_prefix(room).append(user.value().toUtf8());
+}
+
+static std::vector<Room::Receipt> load_receipts(lmdb::txn &txn, lmdb::dbi &db, const RoomID &room) {
+  // Receipts for every room share one database, keyed by room ID and user ID separated by a null
+  std::vector<Room::Receipt> result;
+  const auto prefix = receipt_prefix(room);
+  auto cursor = lmdb::cursor::open(txn, db);
+  lmdb::val key(prefix.data(), prefix.size());
+  lmdb::val value;
+  bool found = cursor.get(key, value, MDB_SET_RANGE);
+  while(found) {
+    const QByteArray key_bytes = QByteArray::fromRawData(key.data(), key.size());
+    if(!key_bytes.startsWith(prefix)) break;
+    const auto obj = QJsonDocument::fromBinaryData(QByteArray(value.data(), value.size())).object();
+    result.push_back(Room::Receipt{UserID{QString::fromUtf8(key_bytes.mid(prefix.size()))},
+                                   EventID{obj["event_id"].toString()},
+                                   static_cast<uint64_t>(obj["ts"].toDouble())});
+    found = cursor.get(key, value, MDB_NEXT);
+  }
+  return result;
 }
 
 Session::Session(Matrix& universe, QUrl homeserver, UserID user_id, QString access_token)
@@ -109,7 +148,8 @@ Session::Session(Matrix& universe, QUrl homeserver, UserID user_id, QString acce
                  SessionInit &&init)
     : universe_(universe), homeserver_(homeserver), user_id_(user_id), access_token_(access_token),
       env_(std::move(init.env)), state_db_(std::move(init.state)), room_db_(std::move(init.room)),
-      buffer_size_(50), synced_(false) {
+      receipt_db_(std::move(init.receipts)),
+      buffer_size_(50), send_window_(1), synced_(false), receipt_scheduler_(RECEIPT_DELAY) {
   {
     auto txn = lmdb::txn::begin(env_, nullptr, MDB_RDONLY);
     lmdb::val stored_batch;
@@ -134,9 +174,10 @@ Session::Session(Matrix& universe, QUrl homeserver, UserID user_id, QString acce
                                      QJsonDocument::fromBinaryData(QByteArray{member_content.data(), static_cast<int>(member_content.size())}).object()}});
           }
         }
+        const auto receipts = load_receipts(txn, receipt_db_, id);
         auto &room = add_room(id, universe_, *this, id,
                               QJsonDocument::fromBinaryData(QByteArray(state.data(), state.size())).object(),
-                              members);
+                              members, receipts);
         room.members = std::move(member_db);
       }
     } else {
@@ -214,10 +255,18 @@ void Session::dispatch(const proto::Sync &sync) {
     if(it == rooms_.end()) {
       auto &room = add_room(joined_room.id, universe_, *this, joined_room);
 
-      for(const auto m : room.room.state().members()) {
+      const auto members = room.room.state().members();
+      room.member_changes.reserve(members.size());
+      for(const auto m : members) {
         room.member_changes.emplace_back(m->first, m->second);
       }
 
+      const auto receipts = room.room.receipts();
+      room.receipt_changes.reserve(receipts.size());
+      for(const auto r : receipts) {
+        room.receipt_changes.push_back(r->user);
+      }
+
       joined(room.room);
     } else {
       auto &room = it->second;
@@ -278,6 +327,14 @@ void Session::update_cache(const proto::Sync &sync) {
           break;
         }
       }
+
+      for(const auto &user : room.receipt_changes) {
+        const auto key = receipt_key(joined_room.id, user);
+        if(auto receipt = room.room.receipt_from(user)) {
+          auto data = QJsonDocument(QJsonObject{{"event_id", receipt->event.value()}, {"ts", static_cast<double>(receipt->ts)}}).toBinaryData();
+          lmdb::dbi_put(txn, receipt_db_, lmdb::val(key.data(), key.size()), lmdb::val(data.data(), data.size()));
+        }
+      }
     }
 
     txn.commit();
@@ -290,6 +347,7 @@ void Session::update_cache(const proto::Sync &sync) {
     for(auto &joined_room : sync.rooms.join) {
       auto &room = rooms_.at(joined_room.id);
       room.member_changes.clear();
+      room.receipt_changes.clear();
     }
 
   } catch(lmdb::runtime_error &e) {
@@ -298,6 +356,13 @@ void Session::update_cache(const proto::Sync &sync) {
   }
 }
 
+void Session::retain_timeline(std::shared_ptr<TimelineCache> cache) {
+  auto it = std::find(retained_timelines_.begin(), retained_timelines_.end(), cache);
+  if(it != retained_timelines_.end()) retained_timelines_.erase(it);
+  retained_timelines_.push_front(std::move(cache));
+  if(retained_timelines_.size() > RETAINED_TIMELINES) retained_timelines_.pop_back();
+}
+
 void Session::log_out() {
   auto reply = post("client/r0/logout", {});
   connect(reply, &QNetworkReply::finished, [this, reply](){
@@ -425,6 +490,10 @@ QUrl Session::ensure_http(const QUrl &url) const {
   return url;
 }
 
+void ContentPost::abort() {
+  if(auto reply = qobject_cast<QNetworkReply *>(parent())) reply->abort();
+}
+
 ContentPost *Session::upload(QIODevice &data, const QString &content_type, const QString &filename) {
   QUrlQuery query;
   query.addQueryItem("filename", filename);
@@ -448,12 +517,15 @@ Session::RoomInfo &Session::add_room(const RoomID &id, Ts &&...ts) {
   auto &room = rooms_.emplace(std::piecewise_construct,
                               std::forward_as_tuple(id),
                               std::forward_as_tuple(std::forward<Ts>(ts)...)).first->second;
-  connect(&room.room, &Room::member_changed, [&room](const UserID &id,
-                                                     const event::room::MemberContent &old,
-                                                     const event::room::MemberContent &current) {
-            (void)old;
-            room.member_changes.emplace_back(id, current);
-          });
+  connect(&room.room, &Room::receipts_changed, [&room](gsl::span<const UserID> users) {
+      room.receipt_changes.insert(room.receipt_changes.end(), users.begin(), users.end());
+    });
+  connect(&room.room, &Room::members_changed, [&room](gsl::span<const MemberChange> changes) {
+      room.member_changes.reserve(room.member_changes.size() + changes.size());
+      for(const auto &change : changes) {
+        room.member_changes.emplace_back(change.user, change.next);
+      }
+    });
   return room;
 }
 
@@ -5,6 +5,8 @@
 #include <chrono>
 #include <experimental/optional>
 #include <vector>
+#include <deque>
+#include <memory>
 
 #include <QObject>
 #include <QString>
@@ -17,6 +19,8 @@
 
 #include "Room.hpp"
 #include "Content.hpp"
+#include "ReceiptScheduler.hpp"
+#include "UploadQueue.hpp"
 
 class QNetworkRequest;
 class QNetworkReply;
@@ -58,6 +62,9 @@ class ContentPost : public QObject {
 public:
   explicit ContentPost(QObject *parent = nullptr) : QObject(parent) {}
 
+  void abort();
+  // Stop sending, after which the data device is no longer read
+
 signals:
   void success(const QString &content_uri);
   void progress(qint64 completed, qint64 total);
@@ -82,6 +89,7 @@ public:
   void log_out();
 
   bool synced() const { return synced_; }
+  const std::experimental::optional<SyncCursor> &next_batch() const { return next_batch_; }
   std::vector<Room *> rooms();
   Room *room_from_id(const RoomID &r) {
     auto it = rooms_.find(r);
@@ -97,11 +105,17 @@ public:
   size_t buffer_size() const { return buffer_size_; }
   void set_buffer_size(size_t size) { buffer_size_ = size; }
 
+  size_t send_window() const { return send_window_; }
+  void set_send_window(size_t size) { send_window_ = size; }
+  // Maximum number of events each room may have in flight at once. Concurrent sends may be processed by the server in
+  // any order, so the default of 1 is the only strictly ordered setting.
+
   QNetworkReply *get(const QString &path, QUrlQuery query = QUrlQuery());
 
   QNetworkReply *post(const QString &path, QJsonObject body = QJsonObject(), QUrlQuery query = QUrlQuery());
 
   QNetworkReply *put(const QString &path, QJsonObject body);
+  // Pipelined requests may share a connection with earlier ones, and so reach the server in the order they were made
 
   ContentFetch *get(const Content &);
 
@@ -116,6 +130,16 @@ public:
   QUrl ensure_http(const QUrl &) const;
   // Converts mxc URLs to http URLs on this homeserver, otherwise passes through
 
+  void schedule_read_receipt(Room &room, const EventID &event) { receipt_scheduler_.schedule(room, event); }
+  // Coalesced per room and dropped if not newer than the last receipt sent or received
+
+  void flush_read_receipts() { receipt_scheduler_.flush(); }
+
+  UploadQueue &uploads() { return upload_queue_; }
+
+  void retain_timeline(std::shared_ptr<TimelineCache> cache);
+  // Keep a recently viewed room's history alive after its views close, up to a fixed number of rooms
+
 signals:
   void logged_out();
   void error(QString message);
@@ -129,10 +153,12 @@ private:
     Room room;
     std::experimental::optional<lmdb::dbi> members;
     std::vector<Member> member_changes;
+    std::vector<UserID> receipt_changes;
 
     RoomInfo(Matrix &universe, Session &session, const proto::JoinedRoom &joined_room) : room{universe, session, joined_room} {}
     RoomInfo(Matrix &universe, Session &session, RoomID id, const QJsonObject &initial,
-             gsl::span<const Member> members) : room{universe, session, id, initial, members} {}
+             gsl::span<const Member> members, gsl::span<const Room::Receipt> receipts)
+      : room{universe, session, id, initial, members, receipts} {}
   };
 
   Matrix &universe_;
@@ -140,13 +166,16 @@ private:
   const UserID user_id_;
   QString access_token_;
   lmdb::env env_;
-  lmdb::dbi state_db_, room_db_;
-  size_t buffer_size_;
+  lmdb::dbi state_db_, room_db_, receipt_db_;
+  size_t buffer_size_, send_window_;
   std::unordered_map<RoomID, RoomInfo> rooms_;
   bool synced_;
   std::experimental::optional<SyncCursor> next_batch_;
   QNetworkReply *sync_reply_;
   QTimer sync_retry_timer_;
+  ReceiptScheduler receipt_scheduler_;
+  UploadQueue upload_queue_;
+  std::deque<std::shared_ptr<TimelineCache>> retained_timelines_;  // Most recently used first
 
   std::chrono::steady_clock::time_point last_sync_error_;
   // Last time a sync failed. Used to ensure we don't spin if errors happen quickly.
@@ -0,0 +1,34 @@
+#include "TimelineCache.hpp"
+
+namespace matrix {
+
+TimelineCache::TimelineCache(std::size_t capacity) : capacity_{capacity}, size_{0} {}
+
+void TimelineCache::insert(const TimelineCursor &begin, const TimelineCursor &end, gsl::span<const event::Room> events,
+                           bool reversed) {
+  if(events.empty() || begin == end || by_begin_.count(begin) || by_end_.count(end)) return;
+
+  auto segment = std::make_shared<const Segment>(Segment{
+      begin, end, reversed ? std::vector<event::Room>(events.rbegin(), events.rend()) : std::vector<event::Room>(events.begin(), events.end())});
+  by_begin_.emplace(begin, segment);
+  by_end_.emplace(end, segment);
+  size_ += segment->events.size();
+  order_.emplace_back(std::move(segment));
+
+  while(size_ > capacity_ && order_.size() > 1) {
+    const auto &oldest = *order_.front();
+    by_begin_.erase(oldest.begin);
+    by_end_.erase(oldest.end);
+    size_ -= oldest.events.size();
+    order_.pop_front();
+  }
+}
+
+std::shared_ptr<const TimelineCache::Segment> TimelineCache::find(Direction dir, const TimelineCursor &from) const {
+  const auto &index = dir == Direction::FORWARD ? by_begin_ : by_end_;
+  auto it = index.find(from);
+  if(it == index.end()) return nullptr;
+  return it->second;
+}
+
+}
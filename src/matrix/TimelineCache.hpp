@@ -0,0 +1,50 @@
+#ifndef NATIVE_CHAT_MATRIX_TIMELINE_CACHE_HPP_
+#define NATIVE_CHAT_MATRIX_TIMELINE_CACHE_HPP_
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <span.h>
+
+#include "Event.hpp"
+
+namespace matrix {
+
+// History of one room that has already been fetched and parsed, shared by every timeline window on that room and kept
+// for a while after the last one closes. Stored as contiguous segments of the timeline keyed by the pagination cursors
+// on either side, so a window paging in either direction can be served without a request.
+//
+// This is a source for windows to page from, not the owner of what they show: each TimelineWindow still keeps its own
+// batches, and derives room state by reverting events rather than from checkpoints stored here. Events copied out of a
+// segment share their JSON with it through Qt's implicit sharing, so those copies cost handles rather than content.
+class TimelineCache {
+public:
+  struct Segment {
+    TimelineCursor begin, end;
+    std::vector<event::Room> events;  // In chronological order
+  };
+
+  explicit TimelineCache(std::size_t capacity);
+
+  void insert(const TimelineCursor &begin, const TimelineCursor &end, gsl::span<const event::Room> events, bool reversed = false);
+  // Segments already known to begin or end at the same place are kept in preference to the new one. Reversed events
+  // are as returned when paging backwards.
+
+  std::shared_ptr<const Segment> find(Direction dir, const TimelineCursor &from) const;
+  // Events a /messages request paging in dir from would return, or null
+
+  std::size_t size() const { return size_; }
+  // Total number of cached events; the oldest insertions are evicted beyond capacity
+
+private:
+  const std::size_t capacity_;
+  std::size_t size_;
+  std::unordered_map<TimelineCursor, std::shared_ptr<const Segment>> by_begin_, by_end_;
+  std::deque<std::shared_ptr<const Segment>> order_;  // Oldest first
+};
+
+}
+
+#endif
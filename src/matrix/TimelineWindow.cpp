@@ -2,8 +2,10 @@
 
 #include <QDebug>
 #include <stdexcept>
+#include <algorithm>
 
 #include "Room.hpp"
+#include "Session.hpp"
 #include "proto.hpp"
 
 using std::experimental::optional;
@@ -13,6 +15,8 @@ namespace matrix {
 namespace {
 
 constexpr size_t BATCH_SIZE = 50;
+constexpr size_t MAX_BATCH_SIZE = 200; // Bounds the latency of each request when prefetching far ahead
+constexpr size_t CONTEXT_SIZE = 20; // Events fetched around the target of a jump; the rest is paged in as usual
 
 void revert_batch(RoomState &state, const Batch &batch) {
   for(auto it = batch.events.crbegin(); it != batch.events.crend(); ++it) {
@@ -20,12 +24,24 @@ void revert_batch(RoomState &state, const Batch &batch) {
   }
 }
 
+void apply_batch(RoomState &state, const Batch &batch) {
+  for(const auto &evt : batch.events) {
+    if(auto s = evt.to_state()) state.apply(*s);
+  }
+}
+
+optional<TimelineCursor> sync_end(const Session &session) {
+  if(auto batch = session.next_batch()) return TimelineCursor{batch->value()};
+  return {};
+}
+
 }
 
-TimelineWindow::TimelineWindow(std::deque<Batch> batches, const RoomState &final_state)
+TimelineWindow::TimelineWindow(std::deque<Batch> batches, const RoomState &final_state, optional<TimelineCursor> sync_end)
   : initial_state_{final_state}, final_state_{final_state},
     batches_{std::move(batches)},
-    sync_batch_{batches_.empty() ? throw std::invalid_argument("timeline window must be construct from at least one batch") : batches_.back()}
+    sync_batch_{batches_.empty() ? throw std::invalid_argument("timeline window must be construct from at least one batch") : batches_.back()},
+    sync_end_{std::move(sync_end)}
 {
   for(auto it = batches_.crbegin(); it != batches_.crend(); ++it) {
     revert_batch(initial_state_, *it);
@@ -34,25 +50,37 @@ TimelineWindow::TimelineWindow(std::deque<Batch> batches, const RoomState &final
 
 void TimelineWindow::discard(const TimelineCursor &batch, Direction dir) {
   if(dir == Direction::FORWARD) {
+    optional<TimelineCursor> gap_until;  // Set iff the earliest batch discarded so far follows a gap
     for(auto it = batches_.crbegin(); it != batches_.crend(); ++it) {
       if(it->begin == batch) {
         if(it.base() != batches_.cend()) {
-          batches_end_ = it.base()->begin;
+          batches_end_ = gap_until ? *gap_until : it.base()->begin;
         }
         batches_.erase(it.base(), batches_.end());
         return;
       }
       revert_batch(final_state_, *it);
+      gap_until = {};
+      auto gap = gap_after(it->begin);
+      if(gap != gaps_.end()) {
+        // Reverting the batch following a gap doesn't account for the missing events
+        final_state_ = gap->state;
+        gap_until = gap->until;
+        gaps_.erase(gap, gaps_.end());
+      }
     }
   } else {
     for(auto it = batches_.cbegin(); it != batches_.cend(); ++it) {
+      auto gap = gap_after(it->begin);
+      if(gap != gaps_.end()) {
+        initial_state_ = gap->after_state;
+        gaps_.erase(gaps_.begin(), std::next(gap));
+      }
       if(it->begin == batch) {
         batches_.erase(batches_.cbegin(), it);
         return;
       }
-      for(const auto &evt : it->events) {
-        if(auto s = evt.to_state()) initial_state_.apply(*s);
-      }
+      apply_batch(initial_state_, *it);
     }
   }
   qCritical() << "timeline window tried to discard unknown batch" << batch.value();
@@ -67,7 +95,7 @@ bool TimelineWindow::at_end() const {
 }
 
 void TimelineWindow::append_batch(const TimelineCursor &batch_start, const TimelineCursor &batch_end, gsl::span<const event::Room> events,
-                                  TimelineManager *mgr) {
+                                  std::size_t limit, TimelineManager *mgr) {
   if(!end() || batch_start != *this->end()) {
     if(end()) mgr->grow(Direction::FORWARD);
     return;
@@ -80,19 +108,16 @@ void TimelineWindow::append_batch(const TimelineCursor &batch_start, const Timel
     ++new_batches;
   }
 
-  if(static_cast<size_t>(events.size()) < BATCH_SIZE) {
+  if(static_cast<size_t>(events.size()) < limit) {
     batches_.emplace_back(sync_batch_);
     batches_end_ = {};
     ++new_batches;
   }
 
   for(size_t i = 0; i < new_batches; ++i) {
-    for(const auto &evt : batches_[batches_.size()-new_batches+i].events) {
-      mgr->grew(Direction::FORWARD, batches_.back().begin, final_state_, evt);
-      if(auto s = evt.to_state()) {
-        final_state_.apply(*s);
-      }
-    }
+    const auto &batch = batches_[batches_.size()-new_batches+i];
+    mgr->grew(Direction::FORWARD, batch.begin, final_state_, batch.events);
+    apply_batch(final_state_, batch);
   }
 }
 
@@ -107,35 +132,75 @@ void TimelineWindow::prepend_batch(const TimelineCursor &batch_start, const Time
 
   batches_.emplace_front(batch_end, std::vector<event::Room>(reversed_events.rbegin(), reversed_events.rend()));
 
-  for(auto it = batches_.front().events.crbegin(); it != batches_.front().events.crend(); ++it) {
-    if(auto s = it->to_state()) initial_state_.revert(*s);
-    mgr->grew(Direction::BACKWARD, batch_start, initial_state_, *it);
-  }
+  revert_batch(initial_state_, batches_.front());
+  mgr->grew(Direction::BACKWARD, batches_.front().begin, initial_state_, batches_.front().events);
 }
 
-void TimelineWindow::append_sync(const proto::Timeline &t, TimelineManager *mgr) {
-  if(t.events.empty()) return;
+void TimelineWindow::append_sync(const proto::Timeline &t, const RoomState &current_state, TimelineManager *mgr) {
+  if(t.events.empty()) {
+    if(t.next_batch) sync_end_ = t.next_batch;
+    return;
+  }
 
-  if(at_end()) {
-    if(t.limited) {
-      batches_.clear();         // FIXME: Don't nuke history
+  const bool was_at_end = at_end();
+  sync_batch_ = Batch{t.prev_batch, t.events};
+  const auto prev_sync_end = std::move(sync_end_);
+  sync_end_ = t.next_batch;
+  if(!was_at_end) return;
+
+  bool gap = false;
+  if(t.limited) {
+    RoomState state = current_state;
+    revert_batch(state, sync_batch_);
+    if(prev_sync_end) {
+      // Keep everything already loaded and fill in the missing events in the background
+      gaps_.push_back(Gap{*prev_sync_end, t.prev_batch, final_state_, state});
+      gap = true;
+    } else {
+      batches_.clear();
+      gaps_.clear();
+      initial_state_ = state;
     }
-    batches_.emplace_back(t.prev_batch, t.events);
+    final_state_ = std::move(state);
   }
 
-  sync_batch_ = Batch{t.prev_batch, t.events};
+  batches_.emplace_back(sync_batch_);
 
-  if(at_end()) {
-    if(t.limited) {
-      mgr->discontinuity();
-    }
+  if(t.limited && !gap) {
+    mgr->discontinuity();
+  }
 
-    for(const auto &evt : sync_batch_.events) {
-      mgr->grew(Direction::FORWARD, sync_batch_.begin, final_state_, evt);
-      if(auto s = evt.to_state()) {
-        final_state_.apply(*s);
-      }
-    }
+  mgr->grew(Direction::FORWARD, sync_batch_.begin, final_state_, sync_batch_.events);
+  apply_batch(final_state_, sync_batch_);
+
+  if(gap) {
+    mgr->gap_changed(sync_batch_.begin, true);
+  }
+}
+
+void TimelineWindow::fill_gap(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+                              std::size_t limit, TimelineManager *mgr) {
+  auto gap = std::find_if(gaps_.begin(), gaps_.end(), [&](const Gap &g) { return g.until == start; });
+  if(gap == gaps_.end()) return;  // Discarded, or the fetch was stale
+
+  auto after = std::find_if(batches_.begin(), batches_.end(), [&](const Batch &b) { return b.begin == gap->after; });
+  if(after == batches_.end()) {
+    qCritical() << "timeline window lost track of the batch following a gap" << gap->after.value();
+    gaps_.erase(gap);
+    return;
+  }
+
+  if(!events.empty()) {
+    after = batches_.emplace(after, start, std::vector<event::Room>(events.begin(), events.end()));
+    mgr->filled(gap->after, start, gap->state, after->events);
+    apply_batch(gap->state, *after);
+    gap->until = end;
+  }
+
+  if(static_cast<size_t>(events.size()) < limit || end == gap->after) {
+    const auto closed = gap->after;
+    gaps_.erase(gap);
+    mgr->gap_changed(closed, false);
   }
 }
 
@@ -143,70 +208,233 @@ void TimelineWindow::reset(const RoomState &current_state) {
   batches_.clear();
   batches_.emplace_back(sync_batch_);
   batches_end_ = {};
+  gaps_.clear();
   final_state_ = current_state;
   initial_state_ = current_state;
   revert_batch(initial_state_, sync_batch_);
 }
 
+void TimelineWindow::anchor(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+                            const RoomState &final_state) {
+  if(events.empty()) throw std::invalid_argument("timeline window must be anchored to at least one event");
+  batches_.clear();
+  batches_.emplace_back(start, std::vector<event::Room>(events.begin(), events.end()));
+  batches_end_ = end;
+  gaps_.clear();
+  final_state_ = final_state;
+  initial_state_ = final_state;
+  revert_batch(initial_state_, batches_.back());
+}
+
+bool TimelineWindow::contains(const EventID &event) const {
+  return std::any_of(batches_.begin(), batches_.end(), [&](const Batch &b) {
+      return std::any_of(b.events.begin(), b.events.end(), [&](const event::Room &e) { return e.id() == event; });
+    });
+}
+
+auto TimelineWindow::gap_after(const TimelineCursor &batch) -> std::deque<Gap>::iterator {
+  return std::find_if(gaps_.begin(), gaps_.end(), [&](const Gap &g) { return g.after == batch; });
+}
+
 
 TimelineManager::TimelineManager(Room &room, QObject *parent)
-  : QObject(parent), room_(room), window_{room.buffer(), room.state()}, forward_req_{nullptr}, backward_req_{nullptr}
+  : QObject(parent), room_(room), cache_{room.timeline_cache()}, window_{room.buffer(), room.state(), sync_end(room.session())},
+    context_req_{nullptr}, fill_req_{nullptr}, fill_limit_{0}
 {
   retry_timer_.setSingleShot(true);
   retry_timer_.setInterval(1000);
   connect(&retry_timer_, &QTimer::timeout, this, &TimelineManager::retry);
+  fill_retry_timer_.setSingleShot(true);
+  fill_retry_timer_.setInterval(1000);
+  connect(&fill_retry_timer_, &QTimer::timeout, this, &TimelineManager::fill);
   connect(&room, &Room::sync_complete, this, &TimelineManager::batch);
 }
 
-void TimelineManager::grow(Direction dir) {
+void TimelineManager::grow(Direction dir, std::size_t events) {
+  auto &p = prefetch(dir);
+  p.wanted = std::max({p.wanted, events, std::size_t{1}});
+  if(!p.req) request(dir);
+}
+
+void TimelineManager::discard(const TimelineCursor &batch, Direction dir) {
+  // Batches that were paged in are cached already; this covers those that arrived by sync
+  const auto &batches = window_.batches();
+  const auto &gaps = window_.gaps();
+  auto it = std::find_if(batches.begin(), batches.end(), [&](const Batch &b) { return b.begin == batch; });
+  if(it != batches.end()) {
+    const auto begin = dir == Direction::FORWARD ? std::next(it) : batches.begin();
+    const auto end = dir == Direction::FORWARD ? batches.end() : it;
+    for(auto b = begin; b != end; ++b) {
+      optional<TimelineCursor> until;  // Cursor following the batch's last event
+      const auto next = std::next(b);
+      if(next != batches.end()) {
+        auto gap = std::find_if(gaps.begin(), gaps.end(), [&](const TimelineWindow::Gap &g) { return g.after == next->begin; });
+        until = gap != gaps.end() ? gap->until : next->begin;
+      } else {
+        until = window_.end();
+      }
+      if(until) cache_->insert(b->begin, *until, b->events);
+    }
+  }
+  window_.discard(batch, dir);
+}
+
+void TimelineManager::cancel(Direction dir) {
+  auto &p = prefetch(dir);
+  p.wanted = 0;
+  if(p.req) {
+    p.req->cancel();
+    p.req = nullptr;
+  }
+  if(retry_timer_.isActive() && retry_dir_ == dir) retry_timer_.stop();
+}
+
+void TimelineManager::request(Direction dir) {
+  auto &p = prefetch(dir);
   optional<TimelineCursor> start, end;
   if(dir == Direction::FORWARD) {
-    if(forward_req_ || window_.at_end()) return;
+    if(window_.at_end()) { p.wanted = 0; return; }
     start = window_.end();
     end = window_.sync_begin();
   } else {
-    if(backward_req_ || window_.at_start()) return;
+    if(window_.at_start()) { p.wanted = 0; return; }
     start = window_.begin();
   }
 
   if(!start) {
     throw std::logic_error("tried to grow from an undefined cursor");
   }
-  auto reply = room_.get_messages(dir, *start, BATCH_SIZE, end);
+  MessageFetch *reply;
+  // Paging forwards into the sync batch must go to the server, which will report that the present has been reached
+  const bool into_sync = end && *start == *end;
+  auto segment = into_sync ? nullptr : cache_->find(dir, *start);
+  if(segment) {
+    p.limit = segment->events.size(); // Never short, lest the end of the segment be mistaken for the present
+    reply = serve(dir, std::move(segment));
+  } else {
+    // Pagination tokens are only known once the previous page arrives, so prefetching further is done with larger
+    // pages rather than concurrent requests.
+    p.limit = std::min(std::max(p.wanted, BATCH_SIZE), MAX_BATCH_SIZE);
+    reply = room_.get_messages(dir, *start, p.limit, end);
+  }
 
   if(dir == Direction::FORWARD) {
     connect(reply, &MessageFetch::finished, this, &TimelineManager::got_forward);
     connect(reply, &MessageFetch::error, this, &TimelineManager::forward_fetch_error);
-    forward_req_ = reply;
   } else {
     connect(reply, &MessageFetch::finished, this, &TimelineManager::got_backward);
     connect(reply, &MessageFetch::error, this, &TimelineManager::backward_fetch_error);
-    backward_req_ = reply;
   }
+  p.req = reply;
+}
+
+MessageFetch *TimelineManager::serve(Direction dir, std::shared_ptr<const TimelineCache::Segment> segment) {
+  auto result = new MessageFetch(this);
+  // Deferred so that cached results are delivered exactly like those from the server
+  QTimer::singleShot(0, result, [result, dir, segment]() {
+      if(dir == Direction::FORWARD) {
+        result->finished(segment->begin, segment->end, segment->events);
+      } else {
+        const std::vector<event::Room> reversed(segment->events.rbegin(), segment->events.rend());
+        result->finished(segment->end, segment->begin, reversed);
+      }
+      result->deleteLater();
+    });
+  return result;
+}
+
+void TimelineManager::received(Direction dir, std::size_t events) {
+  auto &p = prefetch(dir);
+  p.wanted -= std::min(p.wanted, events);
+  if(p.wanted != 0 && !p.req) request(dir);
 }
 
 void TimelineManager::replay() {
   auto replay = window().initial_state();
+  auto gap = window().gaps().cbegin();
   for(const auto &batch : window().batches()) {
-    for(const auto &evt : batch.events) {
-      grew(Direction::FORWARD, batch.begin, replay, evt);
-      if(auto s = evt.to_state()) replay.apply(*s);
+    const bool after_gap = gap != window().gaps().cend() && gap->after == batch.begin;
+    if(after_gap) replay = gap->after_state;
+    grew(Direction::FORWARD, batch.begin, replay, batch.events);
+    apply_batch(replay, batch);
+    if(after_gap) {
+      gap_changed(batch.begin, true);
+      ++gap;
     }
   }
 }
 
+void TimelineManager::jump_to(const EventID &event) {
+  if(context_req_) {
+    context_req_->cancel();
+    context_req_ = nullptr;
+  }
+  if(window_.contains(event)) {
+    anchored(event);
+    return;
+  }
+
+  context_req_ = room_.get_context(event, CONTEXT_SIZE);
+  connect(context_req_, &ContextFetch::finished, this,
+          [this, event](const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+                        std::size_t target, const RoomState &state) {
+            (void)target;
+            got_context(event, start, end, events, state);
+          });
+  connect(context_req_, &ContextFetch::error, this, [this, event](const QString &msg) {
+      context_req_ = nullptr;
+      qWarning() << room_.pretty_name() << "failed to fetch context of" << event.value() << ":" << msg;
+      jump_failed(event, msg);
+    });
+}
+
+void TimelineManager::got_context(const EventID &event, const TimelineCursor &start, const TimelineCursor &end,
+                                  gsl::span<const event::Room> events, const RoomState &state) {
+  context_req_ = nullptr;
+  cancel(Direction::FORWARD);
+  cancel(Direction::BACKWARD);
+  cache_->insert(start, end, events);
+  window_.anchor(start, end, events, state);
+  cleared();
+  replay();
+  anchored(event);
+}
+
 void TimelineManager::retry() {
-  grow(retry_dir_);
+  if(!prefetch(retry_dir_).req) request(retry_dir_);
+}
+
+void TimelineManager::fill() {
+  if(fill_req_ || window_.gaps().empty()) return;
+  // Most recent first, since that's nearest to where the user is likely to be reading
+  const auto &gap = window_.gaps().back();
+  fill_limit_ = BATCH_SIZE;
+  fill_req_ = room_.get_messages(Direction::FORWARD, gap.until, fill_limit_, gap.after);
+  connect(fill_req_, &MessageFetch::finished, this, &TimelineManager::got_fill);
+  connect(fill_req_, &MessageFetch::error, this, &TimelineManager::fill_error);
+}
+
+void TimelineManager::got_fill(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events) {
+  fill_req_ = nullptr;
+  cache_->insert(start, end, events);
+  window_.fill_gap(start, end, events, fill_limit_, this);
+  fill();
+}
+
+void TimelineManager::fill_error(const QString &msg) {
+  fill_req_ = nullptr;
+  qWarning() << room_.pretty_name() << "retrying gap fill due to error:" << msg;
+  if(!fill_retry_timer_.isActive()) fill_retry_timer_.start();
 }
 
 void TimelineManager::forward_fetch_error(const QString &msg) {
-  forward_req_ = nullptr;
-  error(Direction::BACKWARD, msg);
+  forward_.req = nullptr;
+  error(Direction::FORWARD, msg);
 }
 
 void TimelineManager::backward_fetch_error(const QString &msg) {
-  backward_req_ = nullptr;
-  error(Direction::FORWARD, msg);
+  backward_.req = nullptr;
+  error(Direction::BACKWARD, msg);
 }
 
 void TimelineManager::error(Direction dir, const QString &msg) {
@@ -217,17 +445,23 @@ void TimelineManager::error(Direction dir, const QString &msg) {
 }
 
 void TimelineManager::got_backward(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> reversed_events) {
-  backward_req_ = nullptr;
+  backward_.req = nullptr;
+  cache_->insert(end, start, reversed_events, true);
   window_.prepend_batch(start, end, reversed_events, this);
+  received(Direction::BACKWARD, reversed_events.size());
 }
 
 void TimelineManager::got_forward(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events) {
-  forward_req_ = nullptr;
-  window_.append_batch(start, end, events, this);
+  const auto limit = forward_.limit;
+  forward_.req = nullptr;
+  cache_->insert(start, end, events);
+  window_.append_batch(start, end, events, limit, this);
+  received(Direction::FORWARD, events.size());
 }
 
 void TimelineManager::batch(const proto::Timeline &t) {
-  window_.append_sync(t, this);
+  window_.append_sync(t, room_.state(), this);
+  fill();
 }
 
 }
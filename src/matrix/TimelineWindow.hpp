@@ -4,6 +4,7 @@
 #include <deque>
 #include <vector>
 #include <experimental/optional>
+#include <memory>
 
 #include <QObject>
 #include <QTimer>
@@ -12,6 +13,7 @@
 
 #include "Event.hpp"
 #include "Room.hpp"
+#include "TimelineCache.hpp"
 
 namespace matrix {
 
@@ -23,7 +25,16 @@ class TimelineManager;
 
 class TimelineWindow {
 public:
-  TimelineWindow(std::deque<Batch> batches, const RoomState &final_state);
+  // Events missing from the middle of the window, left behind by a limited sync
+  struct Gap {
+    TimelineCursor until;       // Follows the events before the gap; pagination token to fill forwards from
+    TimelineCursor after;       // Begin of the batch following the gap
+    RoomState state;            // State after the events before the gap
+    RoomState after_state;      // State before the batch following the gap
+  };
+
+  TimelineWindow(std::deque<Batch> batches, const RoomState &final_state,
+                 std::experimental::optional<TimelineCursor> sync_end = {});
 
   void discard(const TimelineCursor &, Direction dir);
 
@@ -42,12 +53,24 @@ public:
   void prepend_batch(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> reversed_events,
                      TimelineManager *mgr);
   void append_batch(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
-                    TimelineManager *mgr);
-  void append_sync(const proto::Timeline &t, TimelineManager *mgr);
+                    std::size_t limit, TimelineManager *mgr);
+  // limit is the number of events that were requested; fewer indicates that the present was reached
+  void append_sync(const proto::Timeline &t, const RoomState &current_state, TimelineManager *mgr);
+  void fill_gap(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+                std::size_t limit, TimelineManager *mgr);
+  // Insert events fetched forwards from a gap's until cursor, closing the gap if fewer than limit were received
+
+  const std::deque<Gap> &gaps() const { return gaps_; }
 
   void reset(const RoomState &current_state);
   // Discard all but latest
 
+  void anchor(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events,
+              const RoomState &final_state);
+  // Discard everything in favor of a contiguous run of events elsewhere in history, e.g. from /context
+
+  bool contains(const EventID &event) const;
+
   const RoomState &initial_state() { return initial_state_; }
   const std::deque<Batch> &batches() const { return batches_; }
   const RoomState &final_state() { return final_state_; }
@@ -57,6 +80,10 @@ private:
   std::deque<Batch> batches_;   // have nonempty events
   std::experimental::optional<TimelineCursor> batches_end_;
   Batch sync_batch_;            // may equal batches_.back()
+  std::experimental::optional<TimelineCursor> sync_end_; // Follows sync_batch_
+  std::deque<Gap> gaps_;        // In timeline order
+
+  std::deque<Gap>::iterator gap_after(const TimelineCursor &batch);
 };
 
 class TimelineManager : public QObject {
@@ -68,29 +95,70 @@ public:
   TimelineWindow &window() { return window_; }
   const TimelineWindow &window() const { return window_; }
 
-  void grow(Direction dir);
+  void grow(Direction dir, std::size_t events = 0);
+  // Ensure at least events more events in dir are being fetched, counting any already requested, chaining requests as
+  // needed
+
+  void cancel(Direction dir);
+  // Abandon fetches in dir that haven't completed yet
+
+  void discard(const TimelineCursor &batch, Direction dir);
+  // As TimelineWindow::discard, but keeping the discarded events in the cache so that growing back over them is local
 
   void replay();
 
+  void jump_to(const EventID &event);
+  // Re-anchor the window around event, unless it's already present, then emit anchored
+
 signals:
-  void grew(Direction dir, const TimelineCursor &begin, const RoomState &state, const event::Room &evt);
+  void grew(Direction dir, const TimelineCursor &begin, const RoomState &state, gsl::span<const event::Room> events);
+  // A batch of events in chronological order was added at the dir end of the window. state precedes the first event.
+
+  void filled(const TimelineCursor &after, const TimelineCursor &begin, const RoomState &state, gsl::span<const event::Room> events);
+  // events belong to the batch begin, which lies immediately before the batch after
+
+  void gap_changed(const TimelineCursor &after, bool open);
+  // Whether events are known to be missing immediately before the batch after
+
+  void cleared();
+  // The window was re-anchored; everything previously reported by grew should be discarded
+
+  void anchored(const EventID &event);
+  // event, requested by jump_to, is now in the window
+  void jump_failed(const EventID &event, const QString &message);
 
   void discontinuity();
-  // Gap between successive syncs; if latest batch is being displayed, user should discard it and proceed as if paging
-  // forwards in time
+  // Gap between successive syncs that couldn't be recorded; the window has been reset to the latest batch
 
 private:
   Room &room_;
+  std::shared_ptr<TimelineCache> cache_;
   TimelineWindow window_;
 
-  MessageFetch *forward_req_;
-  MessageFetch *backward_req_;
+  struct Prefetch {
+    MessageFetch *req = nullptr;
+    std::size_t wanted = 0;     // Events still to be fetched, including those in flight
+    std::size_t limit = 0;      // Size of the request in flight
+  };
+
+  Prefetch forward_, backward_;
 
   QTimer retry_timer_;
   Direction retry_dir_;
 
+  ContextFetch *context_req_;
+
+  MessageFetch *fill_req_;
+  std::size_t fill_limit_;
+  QTimer fill_retry_timer_;
+
   // Helpers
   void retry();
+  void fill();
+  Prefetch &prefetch(Direction dir) { return dir == Direction::FORWARD ? forward_ : backward_; }
+  void request(Direction dir);
+  MessageFetch *serve(Direction dir, std::shared_ptr<const TimelineCache::Segment> segment);
+  void received(Direction dir, std::size_t events);
   void error(Direction dir, const QString &msg);
 
   // Signal handlers
@@ -98,6 +166,10 @@ private:
   void backward_fetch_error(const QString &msg);
   void got_backward(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> reversed_events);
   void got_forward(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events);
+  void got_fill(const TimelineCursor &start, const TimelineCursor &end, gsl::span<const event::Room> events);
+  void fill_error(const QString &msg);
+  void got_context(const EventID &event, const TimelineCursor &start, const TimelineCursor &end,
+                   gsl::span<const event::Room> events, const RoomState &state);
   void batch(const proto::Timeline &t);
 };
 
@@ -0,0 +1,237 @@
+#include "UploadQueue.hpp"
+
+#include <limits>
+#include <algorithm>
+
+#include <QFileInfo>
+#include <QMimeDatabase>
+#include <QImageReader>
+#include <QImage>
+#include <QRunnable>
+#include <QTimer>
+#include <QDebug>
+
+#include "Room.hpp"
+#include "Session.hpp"
+
+namespace matrix {
+
+class Upload::Thumbnailer : public QRunnable {
+public:
+  Thumbnailer(Upload &upload, QString path, QSize bound) : upload_(upload), path_{std::move(path)}, bound_{bound} {}
+
+  void run() override {
+    QImageReader reader(path_);
+    const QSize size = reader.size();
+    if(!size.isValid()) {
+      upload_.thumbnailed(QSize(), QByteArray(), QString(), QSize());
+      return;
+    }
+    if(size.width() <= bound_.width() && size.height() <= bound_.height()) {
+      // Small enough that recipients may as well use the original
+      upload_.thumbnailed(size, QByteArray(), QString(), QSize());
+      return;
+    }
+
+    reader.setScaledSize(size.scaled(bound_, Qt::KeepAspectRatio));  // Lets formats like JPEG decode at reduced resolution
+    const QImage image = reader.read();
+    if(image.isNull()) {
+      qDebug() << "couldn't thumbnail" << path_ << reader.errorString();
+      upload_.thumbnailed(size, QByteArray(), QString(), QSize());
+      return;
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    const bool alpha = image.hasAlphaChannel();
+    image.save(&buffer, alpha ? "PNG" : "JPEG");
+    upload_.thumbnailed(size, data, alpha ? "image/png" : "image/jpeg", image.size());
+  }
+
+private:
+  Upload &upload_;
+  const QString path_;
+  const QSize bound_;
+};
+
+Upload::Upload(UploadQueue &queue, Room &room, QString path) : queue_{&queue}, room_{&room}, path_{std::move(path)} {
+  connect(this, &Upload::thumbnailed, this, &Upload::got_thumbnail, Qt::QueuedConnection);
+}
+
+void Upload::start() {
+  started();
+
+  const QFileInfo info(path_);
+  name_ = info.fileName();
+  if(!room_) {
+    fail(tr("Room no longer available"));
+    return;
+  }
+  file_.setFileName(path_);
+  if(!file_.open(QIODevice::ReadOnly)) {
+    fail(tr("Couldn't open %1: %2").arg(name_).arg(file_.errorString()));
+    return;
+  }
+  type_ = QMimeDatabase().mimeTypeForFile(info).name();
+
+  QIODevice *device = &file_;
+  if(file_.size() <= std::numeric_limits<int>::max()) {
+    if(auto data = file_.map(0, file_.size())) {
+      // Stream straight out of the page cache rather than copying through QFile's read buffer
+      mapped_ = QByteArray::fromRawData(reinterpret_cast<const char *>(data), file_.size());
+      mapped_buffer_.setBuffer(&mapped_);
+      mapped_buffer_.open(QIODevice::ReadOnly);
+      device = &mapped_buffer_;
+    }
+  }
+
+  if(type_.startsWith("image/") && queue_) {
+    thumbnail_busy_ = true;
+    ++outstanding_;
+    queue_->thumbnailers_.start(new Thumbnailer(*this, path_, queue_->thumbnail_size()));
+  }
+
+  ++outstanding_;
+  auto post = room_->session().upload(*device, type_, name_);
+  post_ = post;
+  connect(post, &ContentPost::progress, this, &Upload::progress);
+  connect(post, &ContentPost::success, this, [this](const QString &uri) {
+      --outstanding_;
+      url_ = uri;
+      maybe_send();
+      release();
+    });
+  connect(post, &ContentPost::error, this, [this](const QString &msg) {
+      --outstanding_;
+      fail(tr("Couldn't upload %1: %2").arg(name_).arg(msg));
+    });
+}
+
+void Upload::got_thumbnail(QSize dimensions, QByteArray thumbnail, QString thumbnail_type, QSize thumbnail_dimensions) {
+  --outstanding_;
+  dimensions_ = dimensions;
+  if(done_ || thumbnail.isEmpty() || !room_) {
+    thumbnail_busy_ = false;
+    maybe_send();
+    release();
+    return;
+  }
+
+  thumbnail_ = std::move(thumbnail);
+  thumbnail_type_ = std::move(thumbnail_type);
+  thumbnail_dimensions_ = thumbnail_dimensions;
+  thumbnail_buffer_.setBuffer(&thumbnail_);
+  thumbnail_buffer_.open(QIODevice::ReadOnly);
+
+  ++outstanding_;
+  auto post = room_->session().upload(thumbnail_buffer_, thumbnail_type_, "thumbnail-" + name_);
+  thumbnail_post_ = post;
+  connect(post, &ContentPost::success, this, [this](const QString &uri) {
+      --outstanding_;
+      thumbnail_url_ = uri;
+      thumbnail_busy_ = false;
+      maybe_send();
+      release();
+    });
+  connect(post, &ContentPost::error, this, [this](const QString &msg) {
+      // Not fatal; recipients will just have to thumbnail the original themselves
+      --outstanding_;
+      qDebug() << "failed to upload thumbnail for" << path_ << msg;
+      thumbnail_busy_ = false;
+      maybe_send();
+      release();
+    });
+}
+
+void Upload::maybe_send() {
+  if(done_ || !url_ || thumbnail_busy_) return;
+  if(room_) {
+    if(dimensions_.isValid()) {
+      std::experimental::optional<ImageThumbnail> thumbnail;
+      if(thumbnail_url_) {
+        thumbnail = ImageThumbnail{*thumbnail_url_, thumbnail_type_, static_cast<size_t>(thumbnail_.size()), thumbnail_dimensions_};
+      }
+      room_->send_image(*url_, name_, type_, file_.size(), dimensions_, thumbnail);
+    } else {
+      room_->send_file(*url_, name_, type_, file_.size());
+    }
+  }
+  finished();
+  done();
+}
+
+void Upload::fail(const QString &message) {
+  if(done_) return;
+  error(message);
+  done();
+  release();
+}
+
+void Upload::done() {
+  done_ = true;
+  if(queue_) queue_->finished_one();
+}
+
+void Upload::release() {
+  // Worker threads and in-flight requests refer to this object, so it must outlive them
+  if(done_ && outstanding_ == 0) deleteLater();
+}
+
+void Upload::abort() {
+  // Requests read from our file and buffers, so they must be stopped before this object is destroyed
+  done_ = true;
+  queue_.clear();
+  if(post_) post_->abort();
+  if(thumbnail_post_) thumbnail_post_->abort();
+}
+
+UploadQueue::UploadQueue(std::size_t parallelism, QObject *parent)
+  : QObject{parent}, parallelism_{parallelism}, thumbnail_size_{800, 600} {}
+
+UploadQueue::~UploadQueue() {
+  for(auto &upload : started_) {
+    if(upload) upload->abort();
+  }
+  // Thumbnailers refer to their uploads directly
+  thumbnailers_.waitForDone();
+  for(auto &upload : started_) {
+    delete upload.data();
+  }
+  for(auto &upload : waiting_) {
+    delete upload.data();
+  }
+}
+
+Upload *UploadQueue::enqueue(Room &room, const QString &path) {
+  auto upload = new Upload(*this, room, path);
+  waiting_.emplace_back(upload);
+  // Deferred so that the caller can connect to the upload's signals before anything happens
+  QTimer::singleShot(0, this, &UploadQueue::start_next);
+  return upload;
+}
+
+void UploadQueue::set_parallelism(std::size_t n) {
+  parallelism_ = n;
+  start_next();
+}
+
+void UploadQueue::start_next() {
+  while(active_ < parallelism_ && !waiting_.empty()) {
+    QPointer<Upload> upload = waiting_.front();
+    waiting_.pop_front();
+    if(!upload) continue;
+    ++active_;
+    started_.erase(std::remove_if(started_.begin(), started_.end(), [](const QPointer<Upload> &u) { return !u; }),
+                   started_.end());
+    started_.push_back(upload);
+    upload->start();
+  }
+}
+
+void UploadQueue::finished_one() {
+  --active_;
+  QTimer::singleShot(0, this, &UploadQueue::start_next);
+}
+
+}
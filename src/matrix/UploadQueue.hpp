@@ -0,0 +1,110 @@
+#ifndef NACHAT_MATRIX_UPLOAD_QUEUE_HPP_
+#define NACHAT_MATRIX_UPLOAD_QUEUE_HPP_
+
+#include <deque>
+#include <vector>
+#include <experimental/optional>
+
+#include <QObject>
+#include <QPointer>
+#include <QFile>
+#include <QBuffer>
+#include <QByteArray>
+#include <QSize>
+#include <QThreadPool>
+
+namespace matrix {
+
+class Room;
+class UploadQueue;
+class ContentPost;
+
+// A file being uploaded and then sent to a room as an m.file or m.image event. Deletes itself once finished.
+class Upload : public QObject {
+  Q_OBJECT
+
+public:
+  const QString &path() const { return path_; }
+
+signals:
+  void started();
+  void progress(qint64 completed, qint64 total);
+  void finished();
+  void error(const QString &message);
+
+  void thumbnailed(QSize dimensions, QByteArray thumbnail, QString thumbnail_type, QSize thumbnail_dimensions);
+  // Emitted from a worker thread; delivered to this object's thread by a queued connection
+
+private:
+  friend class UploadQueue;
+
+  class Thumbnailer;
+
+  QPointer<UploadQueue> queue_;
+  QPointer<Room> room_;
+  const QString path_;
+  QString name_, type_;
+
+  QFile file_;
+  QByteArray mapped_;  // Refers directly to the memory-mapped file, if mapping succeeded
+  QBuffer mapped_buffer_;
+  std::experimental::optional<QString> url_;
+  QPointer<ContentPost> post_, thumbnail_post_;
+
+  bool thumbnail_busy_ = false;  // Until the thumbnail is uploaded or abandoned
+  QSize dimensions_;
+  QByteArray thumbnail_;
+  QBuffer thumbnail_buffer_;
+  QString thumbnail_type_;
+  QSize thumbnail_dimensions_;
+  std::experimental::optional<QString> thumbnail_url_;
+
+  unsigned outstanding_ = 0;  // Requests and worker jobs referring to this object
+  bool done_ = false;
+
+  Upload(UploadQueue &queue, Room &room, QString path);
+
+  void start();
+  void got_thumbnail(QSize dimensions, QByteArray thumbnail, QString thumbnail_type, QSize thumbnail_dimensions);
+  void maybe_send();
+  void fail(const QString &message);
+  void done();
+  void release();
+  void abort();
+};
+
+// Uploads files with bounded parallelism. Images are measured and thumbnailed on worker threads while the original
+// uploads, and the thumbnail is uploaded alongside it.
+class UploadQueue : public QObject {
+  Q_OBJECT
+
+public:
+  explicit UploadQueue(std::size_t parallelism = 2, QObject *parent = nullptr);
+  ~UploadQueue();
+
+  Upload *enqueue(Room &room, const QString &path);
+
+  std::size_t parallelism() const { return parallelism_; }
+  void set_parallelism(std::size_t n);
+
+  QSize thumbnail_size() const { return thumbnail_size_; }
+  void set_thumbnail_size(QSize size) { thumbnail_size_ = size; }
+  // Images that fit within this size are not thumbnailed
+
+private:
+  friend class Upload;
+
+  std::size_t parallelism_;
+  std::size_t active_ = 0;
+  std::deque<QPointer<Upload>> waiting_;
+  std::vector<QPointer<Upload>> started_;  // Possibly still referred to by requests or workers
+  QSize thumbnail_size_;
+  QThreadPool thumbnailers_;
+
+  void start_next();
+  void finished_one();
+};
+
+}
+
+#endif
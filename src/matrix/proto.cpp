@@ -68,6 +68,7 @@ Sync parse_sync(QJsonValue v) {
     sync.rooms.join.reserve(join.size());
     for(auto i = join.begin(); i != join.end(); ++i) {
       sync.rooms.join.push_back(parse_joined_room(i.key(), i.value()));
+      sync.rooms.join.back().timeline.next_batch = TimelineCursor{sync.next_batch.value()};
     }
 
     auto leave = rooms["leave"].toObject();
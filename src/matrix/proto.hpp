@@ -2,6 +2,7 @@
 #define NATIVE_CHAT_MATRIX_PROTO_HPP_
 
 #include <vector>
+#include <experimental/optional>
 
 #include <QString>
 
@@ -25,6 +26,7 @@ struct State {
 struct Timeline {
   bool limited;
   TimelineCursor prev_batch;
+  std::experimental::optional<TimelineCursor> next_batch; // The sync's next_batch, which also follows the events here
   std::vector<event::Room> events;
 
   explicit Timeline(TimelineCursor &&prev) : prev_batch{std::move(prev)} {}
@@ -5,6 +5,7 @@
 #include "matrix/Room.hpp"
 
 #include "ContentCache.hpp"
+#include "MemoryBudget.hpp"
 #include "TimelineView.hpp"
 
 matrix::event::Room room_evt(const QJsonObject &o) {
@@ -30,7 +31,8 @@ int main(int argc, char *argv[]) {
       c.set(thumb, pixmap);
     });
 
-  TimelineView tv(QUrl("https://example.com/"), c);
+  MemoryBudget budget;
+  TimelineView tv(QUrl("https://example.com/"), c, budget);
   tv.show();
 
   matrix::RoomState rs;